@@ -0,0 +1,114 @@
+#!/bin/sh
+# Generate synthetic flows and time the interpreter on them.
+#
+#   bench/flowbench.sh [-d depth] [-f fan_in] [-m MB] [-r runs] [-k cat|builtin]
+#
+# The generated flow has fan_in branches. Each branch is a source writing
+# MB/fan_in megabytes followed by depth stages of nested pipes. A concatenate
+# joins the branches, and the target pipes that into wc -c. -k picks the stage:
+# a forked `cat` or an in-process `builtin=sub`.
+#
+# Every run is traced with -t. Each run prints its wall time (end-to-end
+# latency), throughput, and how many processes the trace recorded per second.
+# The last line gives the median of each column over all runs.
+
+DEPTH=4
+FANIN=2
+MB=256
+RUNS=5
+KIND=cat
+while getopts "d:f:m:r:k:" opt; do
+    case $opt in
+        d) DEPTH=$OPTARG ;;
+        f) FANIN=$OPTARG ;;
+        m) MB=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        k) KIND=$OPTARG ;;
+        *) sed -n '4p' "$0" >&2; exit 1 ;;
+    esac
+done
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+FLOW_BIN=${FLOW_BIN:-$DIR/flow}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+if [ ! -x "$FLOW_BIN" ]; then
+    gcc -O2 -pthread -o "$TMP/flow" "$DIR/flow.c" || exit 1
+    FLOW_BIN=$TMP/flow
+fi
+
+BYTES=$((MB * 1024 * 1024 / FANIN))
+TOTAL=$((BYTES * FANIN))
+
+{
+    echo "node=count"
+    echo "command=wc -c"
+    if [ "$KIND" = builtin ]; then
+        echo "node=stage"
+        echo "builtin=sub x y"
+    else
+        echo "node=stage"
+        echo "command=cat"
+    fi
+
+    b=0
+    while [ "$b" -lt "$FANIN" ]; do
+        echo "node=src$b"
+        echo "command=yes 'flowbench line of text' | head -c $BYTES"
+        prev=src$b
+        d=1
+        while [ "$d" -le "$DEPTH" ]; do
+            echo "pipe=b${b}_$d"
+            echo "from=$prev"
+            echo "to=stage"
+            prev=b${b}_$d
+            d=$((d + 1))
+        done
+        b=$((b + 1))
+    done
+
+    echo "concatenate=join"
+    echo "parts=$FANIN"
+    b=0
+    while [ "$b" -lt "$FANIN" ]; do
+        if [ "$DEPTH" -gt 0 ]; then echo "part_$b=b${b}_$DEPTH"; else echo "part_$b=src$b"; fi
+        b=$((b + 1))
+    done
+
+    echo "pipe=bench"
+    echo "from=join"
+    echo "to=count"
+} > "$TMP/bench.flow"
+
+now() { date +%s.%N; }
+
+echo "# depth=$DEPTH fan_in=$FANIN ${MB}MB stage=$KIND runs=$RUNS"
+printf "%-4s %10s %10s %8s %10s\n" run seconds MB/s procs procs/s
+run=1
+while [ "$run" -le "$RUNS" ]; do
+    start=$(now)
+    bytes=$("$FLOW_BIN" -t "$TMP/trace.json" "$TMP/bench.flow" bench | awk 'NR == 1 { print $1 }')
+    end=$(now)
+    if [ "$bytes" != "$TOTAL" ]; then
+        echo "run $run: expected $TOTAL bytes, got '$bytes'" >&2
+        exit 1
+    fi
+    procs=$(grep -c '"cat":"process"' "$TMP/trace.json")
+    awk -v r="$run" -v s="$start" -v e="$end" -v mb="$MB" -v p="$procs" \
+        'BEGIN { t = e - s; printf "%-4d %10.3f %10.1f %8d %10.1f\n", r, t, mb / t, p, p / t }'
+    run=$((run + 1))
+done | tee "$TMP/runs"
+
+# median of each column
+awk '{ for (c = 2; c <= 5; c++) v[c, NR] = $c; n = NR }
+     END {
+         printf "%-4s", "med"
+         for (c = 2; c <= 5; c++) {
+             for (i = 1; i <= n; i++) a[i] = v[c, i]
+             for (i = 2; i <= n; i++) for (j = i; j > 1 && a[j - 1] > a[j]; j--) { x = a[j]; a[j] = a[j - 1]; a[j - 1] = x }
+             m = n % 2 ? a[(n + 1) / 2] : (a[n / 2] + a[n / 2 + 1]) / 2
+             printf c == 5 || c == 3 ? " %10.1f" : c == 4 ? " %8d" : " %10.3f", m
+         }
+         printf "\n"
+     }' "$TMP/runs"
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Measure MB/s through chains of pipes of increasing depth.
+#
+#   bench/pipe_throughput.sh [MB] [max_depth] [buffer] [ring]
+#
+# Each chain is gen | cat | cat | ... | wc -c, built as nested pipes so every
+# stage goes through run_pipe_into_fd(). buffer and ring are written into every
+# pipe as buffer=/ring= (use 0 to leave one out), so runs with different values
+# can be compared side by side.
+
+MB=${1:-256}
+MAX_DEPTH=${2:-8}
+BUFFER=${3:-0}
+RING=${4:-0}
+
+DIR=$(cd "$(dirname "$0")/.." && pwd)
+FLOW_BIN=${FLOW_BIN:-$DIR/flow}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+if [ ! -x "$FLOW_BIN" ]; then
+    gcc -O2 -o "$TMP/flow" "$DIR/flow.c" || exit 1
+    FLOW_BIN=$TMP/flow
+fi
+
+# write a flow whose target pipe p<depth> has <depth> cat stages before wc
+make_flow() {
+    depth=$1
+    {
+        echo "node=gen"
+        echo "command=head -c ${MB}M /dev/zero"
+        echo "node=count"
+        echo "command=wc -c"
+        echo "node=cat"
+        echo "command=cat"
+        prev=gen
+        i=1
+        while [ "$i" -le "$depth" ]; do
+            to=cat
+            [ "$i" -eq "$depth" ] && to=count
+            echo "pipe=p$i"
+            echo "from=$prev"
+            echo "to=$to"
+            [ "$BUFFER" != 0 ] && echo "buffer=$BUFFER"
+            [ "$RING" != 0 ] && echo "ring=$RING"
+            prev=p$i
+            i=$((i + 1))
+        done
+    } > "$TMP/chain.flow"
+}
+
+now() { date +%s.%N; }
+
+echo "# ${MB}MB per run, buffer=$BUFFER ring=$RING"
+printf "%-6s %10s %10s\n" depth seconds MB/s
+depth=1
+while [ "$depth" -le "$MAX_DEPTH" ]; do
+    make_flow "$depth"
+    start=$(now)
+    bytes=$("$FLOW_BIN" "$TMP/chain.flow" "p$depth" | awk 'NR == 1 { print $1 }')
+    end=$(now)
+    if [ "$bytes" != $((MB * 1024 * 1024)) ]; then
+        echo "depth $depth: expected $((MB * 1024 * 1024)) bytes, got '$bytes'" >&2
+        exit 1
+    fi
+    awk -v d="$depth" -v s="$start" -v e="$end" -v mb="$MB" \
+        'BEGIN { t = e - s; printf "%-6d %10.3f %10.1f\n", d, t, mb / t }'
+    depth=$((depth * 2))
+done
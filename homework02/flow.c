@@ -1,437 +1,3246 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define MAX_NODES 128
-#define MAX_PIPES 10
-#define MAX_CONCATS 64
 #define MAX_PARTS 32
 #define MAX_NAME_LEN 64
 #define CMD_LEN 1024
-#define LINE_LEN  2048
+#define TEE_CHUNK (64 * 1024)
+#define TEE_PIPE_SZ (1024 * 1024)
+#define MAX_WORKERS 64
+#define PAR_CHUNK (1024 * 1024)
+#define CACHE_DIR ".flow-cache"
+
+enum { BUILTIN_NONE, BUILTIN_WC, BUILTIN_WC_L, BUILTIN_WC_W, BUILTIN_WC_C,
+       BUILTIN_SUB, BUILTIN_HEAD, BUILTIN_TAIL, BUILTIN_GREP,
+       BUILTIN_SOURCE, BUILTIN_SINK };
 
 typedef struct {
     char name[MAX_NAME_LEN];
     char command[CMD_LEN];
+    int cacheable;          // output may be replayed from the cache
+    char inputs[CMD_LEN];   // space-separated files the output depends on
+    char outputs[CMD_LEN];  // space-separated files it writes, for -i
+    int has_cpus;           // pinned to the CPUs in cpus
+    cpu_set_t cpus;
+    int nice;               // added to the inherited nice value
+    size_t memory;          // address-space limit in bytes (0 = none)
+    double timeout;         // seconds before the node's process group is killed (0 = none)
+    int builtin;            // BUILTIN_* run inside the interpreter instead of command
+    long builtin_n;         // line count for head/tail
+    char pattern[MAX_NAME_LEN];      // text for sub/grep
+    char replacement[MAX_NAME_LEN];  // replacement for sub
+    char path[CMD_LEN - 16]; // file a source= reads or a sink= writes
+    int append;             // sink= appends instead of truncating
+    int line;               // where the component starts in the flow file
 } Node;
 
+static int is_file_node(const Node *n) {
+    return n->builtin == BUILTIN_SOURCE || n->builtin == BUILTIN_SINK;
+}
+
 typedef struct {
     char name[MAX_NAME_LEN];
     char from[MAX_NAME_LEN];
     char to[MAX_NAME_LEN];
+    size_t buffer;     // kernel pipe capacity (0 = the -b default)
+    size_t ring;       // size of a user-space ring between the two ends (0 = none)
+    int checkpoint;    // spool the producer's output so a failed run can resume here
+    int shm;           // transport=shm: builtin ends share a memory ring instead
+    int line;
 } Pipe;
 
 typedef struct {
     char name[MAX_NAME_LEN];
     int parts;
     char part_name[MAX_PARTS][MAX_NAME_LEN];
+    int line;
 } Concat;
 
 typedef struct {
     char name[MAX_NAME_LEN];
     char from_node[MAX_NAME_LEN];
+    int line;
 } Stderr;
 
-static Node node_array[MAX_NODES];
-static int node_count = 0;
+typedef struct {
+    char name[MAX_NAME_LEN];
+    char from[MAX_NAME_LEN];
+    int parts;
+    char part_name[MAX_PARTS][MAX_NAME_LEN];
+    int line;
+} Tee;
+
+typedef struct {
+    char name[MAX_NAME_LEN];
+    char from[MAX_NAME_LEN];
+    char worker[MAX_NAME_LEN];
+    int workers;       // instances of worker running at once (0 = one per CPU)
+    int split_bytes;   // cut chunks at exact byte counts instead of line ends
+    size_t chunk;      // target chunk size in bytes
+    int unordered;     // emit chunk results as they finish, not in input order
+    int line;
+} Parallel;
+
+typedef struct {
+    char name[MAX_NAME_LEN];
+    char from[MAX_NAME_LEN];   // node run once for both streams
+    char out[MAX_NAME_LEN];    // node reading its stdout (empty = straight to our output)
+    char err[MAX_NAME_LEN];    // node reading its stderr (empty = left alone)
+    int line;
+} Streams;
+
+typedef enum { KIND_NODE, KIND_PIPE, KIND_CONCAT, KIND_STDERR, KIND_TEE, KIND_PARALLEL, KIND_STREAMS } Kind;
 
-static Pipe pipe_array[MAX_PIPES];
-static int pipe_count = 0;
+static const char *kind_names[] = { "node", "pipe", "concatenate", "stderr", "tee", "parallel", "streams" };
 
-static Concat concat_array[MAX_CONCATS];
-static int concat_count = 0;
+// The parsed flow: one symbol per named component, pointing into the array for its kind
+typedef struct {
+    char name[MAX_NAME_LEN];
+    Kind kind;
+    int index;
+    int line;
+} Symbol;
+
+static Node *node_array;
+static int node_count = 0, node_cap = 0;
+
+static Pipe *pipe_array;
+static int pipe_count = 0, pipe_cap = 0;
+
+static Concat *concat_array;
+static int concat_count = 0, concat_cap = 0;
+
+static Stderr *stderr_array;
+static int stderr_count = 0, stderr_cap = 0;
+
+static Tee *tee_array;
+static int tee_count = 0, tee_cap = 0;
+
+static Parallel *parallel_array;
+static int parallel_count = 0, parallel_cap = 0;
 
-static Stderr stderr_array[MAX_CONCATS];
-static int stderr_count = 0;
+static Streams *streams_array;
+static int streams_count = 0, streams_cap = 0;
 
-// defines a buffered node externally so it's accessible and 'partializable'
-static Node buffered_node;
-static Pipe buffered_pipe;
-static Concat buffered_concat;
-static Stderr buffered_stderr;
-static int expected_parts = 0;
-static int collected_parts = 0;
+static Symbol *symbols;
+static int symbol_count = 0, symbol_cap = 0;
+
+// open-addressing index over symbols by name; -1 marks an empty slot
+static int *symbol_slots;
+static size_t symbol_slot_cap = 0;
 
 /* HELPERS */
-static int node_is_complete(const Node *nodePtr) {
-    return (nodePtr->name[0] && nodePtr->command[0]);
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
 }
 
-static int pipe_is_complete(const Pipe *pipePtr) {
-    return (pipePtr->name[0] && pipePtr->from[0] && pipePtr->to[0]);
+static uint64_t hash_name(const char *name) {
+    return fnv1a(0xcbf29ce484222325ULL, name, strlen(name));
 }
 
-static int concat_is_complete(const Concat *concatPtr) {
-    return (concatPtr->name[0] && concatPtr->parts > 0);
+// make room for one more element in a growable array
+static void *grow_array(void *arr, int count, int *cap, size_t elem) {
+    if (count < *cap) return arr;
+    int ncap = *cap ? *cap * 2 : 16;
+    void *grown = realloc(arr, (size_t)ncap * elem);
+    if (!grown) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    *cap = ncap;
+    return grown;
 }
 
-static int stderr_is_complete(const Stderr *stderrPtr) {
-    return (stderrPtr->name[0] && stderrPtr->from_node[0]);
+static const Symbol *lookup(const char *name) {
+    if (symbol_slot_cap == 0) return NULL;
+    size_t mask = symbol_slot_cap - 1;
+    for (size_t i = hash_name(name) & mask; symbol_slots[i] >= 0; i = (i + 1) & mask) {
+        const Symbol *s = &symbols[symbol_slots[i]];
+        if (strcmp(s->name, name) == 0) return s;
+    }
+    return NULL;
 }
 
-static const Node* get_node_by_name(const Node node_array[], int node_count, const char *name) {
-    for (int i = 0; i < node_count; i++) {
-        if (strcmp(node_array[i].name, name) == 0) {
-            return &node_array[i];  // type: const Node*
+static void index_symbol(int idx) {
+    size_t mask = symbol_slot_cap - 1;
+    size_t i = hash_name(symbols[idx].name) & mask;
+    while (symbol_slots[i] >= 0) i = (i + 1) & mask;
+    symbol_slots[i] = idx;
+}
+
+// register a component name; returns the earlier symbol if the name is taken
+static const Symbol *add_symbol(const char *name, Kind kind, int index, int line) {
+    const Symbol *prev = lookup(name);
+    if (prev) return prev;
+
+    symbols = grow_array(symbols, symbol_count, &symbol_cap, sizeof *symbols);
+    Symbol *s = &symbols[symbol_count];
+    strcpy(s->name, name);
+    s->kind = kind;
+    s->index = index;
+    s->line = line;
+    symbol_count++;
+
+    // keep the index at most half full
+    if ((size_t)symbol_count * 2 > symbol_slot_cap) {
+        size_t cap = symbol_slot_cap ? symbol_slot_cap * 2 : 64;
+        while ((size_t)symbol_count * 2 > cap) cap *= 2;
+        int *slots = realloc(symbol_slots, cap * sizeof *slots);
+        if (!slots) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
         }
+        symbol_slots = slots;
+        symbol_slot_cap = cap;
+        memset(symbol_slots, -1, cap * sizeof *slots);
+        for (int i = 0; i < symbol_count; i++) index_symbol(i);
+    } else {
+        index_symbol(symbol_count - 1);
+    }
+    return NULL;
+}
+
+static const Node* get_node_by_name(const Node node_array[], int node_count, const char *name) {
+    const Symbol *s = lookup(name);
+    if (s && s->kind == KIND_NODE && s->index < node_count) {
+        return &node_array[s->index];  // type: const Node*
     }
     return NULL;
 }
 
 static const Pipe* get_pipe_by_name(const Pipe pipe_array[], int pipe_count, const char *name) {
-    for (int i = 0; i < pipe_count; i++) {
-        if (strcmp(pipe_array[i].name, name) == 0) {
-            return &pipe_array[i];  // const Pipe*
-        }
+    const Symbol *s = lookup(name);
+    if (s && s->kind == KIND_PIPE && s->index < pipe_count) {
+        return &pipe_array[s->index];  // const Pipe*
     }
     return NULL;
 }
 
 static const Concat* get_concat_by_name(const Concat concat_array[], int concat_count, const char *name) {
-    for (int i = 0; i < concat_count; i++) {
-        if (strcmp(concat_array[i].name, name) == 0) {
-            return &concat_array[i];
-        }
+    const Symbol *s = lookup(name);
+    if (s && s->kind == KIND_CONCAT && s->index < concat_count) {
+        return &concat_array[s->index];
     }
     return NULL;
 }
 
 static const Stderr* get_stderr_by_name(const Stderr stderr_array[], int stderr_count, const char *name) {
-    for (int i = 0; i < stderr_count; i++) {
-        if (strcmp(stderr_array[i].name, name) == 0) {
-            return &stderr_array[i];
-        }
+    const Symbol *s = lookup(name);
+    if (s && s->kind == KIND_STDERR && s->index < stderr_count) {
+        return &stderr_array[s->index];
     }
     return NULL;
 }
 
-/* I/O */
-
-int parse_line(char buffer[]) {
-    char *key = strtok(buffer, "=");
-    char *value = strtok(NULL, "\n");
-
-    if (strcmp(key, "node") == 0) {
-        strncpy(buffered_node.name, value, MAX_NAME_LEN-1);
-        buffered_node.name[MAX_NAME_LEN-1] = '\0';
+static const Tee* get_tee_by_name(const Tee tee_array[], int tee_count, const char *name) {
+    const Symbol *s = lookup(name);
+    if (s && s->kind == KIND_TEE && s->index < tee_count) {
+        return &tee_array[s->index];
     }
+    return NULL;
+}
 
-    if (strcmp(key, "command") == 0) {
-        strncpy(buffered_node.command, value, CMD_LEN-1);
-        buffered_node.command[CMD_LEN-1] = '\0';
+static const Parallel* get_parallel_by_name(const Parallel parallel_array[], int parallel_count, const char *name) {
+    const Symbol *s = lookup(name);
+    if (s && s->kind == KIND_PARALLEL && s->index < parallel_count) {
+        return &parallel_array[s->index];
     }
+    return NULL;
+}
 
-    if (strcmp(key, "pipe") == 0) {
-        strncpy(buffered_pipe.name, value, MAX_NAME_LEN-1);
-        buffered_pipe.name[MAX_NAME_LEN-1] = '\0';
+static const Streams* get_streams_by_name(const Streams streams_array[], int streams_count, const char *name) {
+    const Symbol *s = lookup(name);
+    if (s && s->kind == KIND_STREAMS && s->index < streams_count) {
+        return &streams_array[s->index];
     }
+    return NULL;
+}
 
-    if (strcmp(key, "from") == 0) {
-        strncpy(buffered_pipe.from, value, MAX_NAME_LEN-1);
-        buffered_pipe.from[MAX_NAME_LEN-1] = '\0';
+// names of the components s reads from, in the order they are run; returns how many
+static int component_refs(const Symbol *s, const char *refs[MAX_PARTS + 1]) {
+    int n = 0;
+    switch (s->kind) {
+    case KIND_NODE:
+        break;
+    case KIND_PIPE:
+        refs[n++] = pipe_array[s->index].from;
+        refs[n++] = pipe_array[s->index].to;
+        break;
+    case KIND_CONCAT:
+        for (int i = 0; i < concat_array[s->index].parts; i++) refs[n++] = concat_array[s->index].part_name[i];
+        break;
+    case KIND_STDERR:
+        refs[n++] = stderr_array[s->index].from_node;
+        break;
+    case KIND_TEE:
+        refs[n++] = tee_array[s->index].from;
+        for (int i = 0; i < tee_array[s->index].parts; i++) refs[n++] = tee_array[s->index].part_name[i];
+        break;
+    case KIND_PARALLEL:
+        refs[n++] = parallel_array[s->index].from;
+        refs[n++] = parallel_array[s->index].worker;
+        break;
+    case KIND_STREAMS:
+        refs[n++] = streams_array[s->index].from;
+        if (streams_array[s->index].out[0]) refs[n++] = streams_array[s->index].out;
+        if (streams_array[s->index].err[0]) refs[n++] = streams_array[s->index].err;
+        break;
     }
+    return n;
+}
 
-    if (strcmp(key, "to") == 0) {
-        strncpy(buffered_pipe.to, value, MAX_NAME_LEN-1);
-        buffered_pipe.to[MAX_NAME_LEN-1] = '\0';
-    }
+/* I/O */
 
-    // Handle stderr directive
-    if (strcmp(key, "stderr") == 0) {
-        memset(&buffered_stderr, 0, sizeof buffered_stderr);
-        strncpy(buffered_stderr.name, value, MAX_NAME_LEN-1);
-        buffered_stderr.name[MAX_NAME_LEN-1] = '\0';
-    }
+// A flow file is a sequence of components. Each one starts with a kind line
+// (node=, pipe=, concatenate=, stderr=, tee=, parallel=) naming it, and every
+// key=value line after that belongs to it until the next kind line. Blank lines
+// and lines starting with '#' are ignored.
 
-    if (strcmp(key, "from") == 0 && buffered_stderr.name[0]) {
-        strncpy(buffered_stderr.from_node, value, MAX_NAME_LEN-1);
-        buffered_stderr.from_node[MAX_NAME_LEN-1] = '\0';
-    }
+typedef struct {
+    const char *path;
+    int line;          // current line number
+    int errors;
+    int open;          // a component is being read
+    int skipping;      // the last kind line was bad, so ignore its settings
+    Kind kind;         // ... of this kind
+    int index;         // ... at this index in its array
+    int start;         // ... starting on this line
+} Parser;
+
+static void parse_error(Parser *ps, int line, const char *fmt, ...) {
+    va_list ap;
+    fprintf(stderr, "%s:%d: ", ps->path, line);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    ps->errors++;
+}
 
-    // Handle concatenate directive
-    if (strcmp(key, "concatenate") == 0) {
-        memset(&buffered_concat, 0, sizeof buffered_concat);
-        strncpy(buffered_concat.name, value, MAX_NAME_LEN-1);
-        buffered_concat.name[MAX_NAME_LEN-1] = '\0';
-        expected_parts = 0;
-        collected_parts = 0;
+// copy a value into a fixed-size field, refusing values that would be cut short
+static void set_field(Parser *ps, char *dst, size_t cap, const char *key, const char *val, size_t len) {
+    if (dst[0]) {
+        parse_error(ps, ps->line, "'%s' is set twice", key);
+        return;
+    }
+    if (len == 0) {
+        parse_error(ps, ps->line, "'%s' is empty", key);
+        return;
     }
+    if (len >= cap) {
+        parse_error(ps, ps->line, "'%s' is longer than %zu characters", key, cap - 1);
+        return;
+    }
+    memcpy(dst, val, len);
+    dst[len] = '\0';
+}
 
-    if (strcmp(key, "parts") == 0 && buffered_concat.name[0]) {
-        expected_parts = atoi(value);
+static long parse_number(Parser *ps, const char *key, const char *val, size_t len, long min, long max) {
+    char buf[32];
+    char *end = NULL;
+    if (len == 0 || len >= sizeof buf) {
+        parse_error(ps, ps->line, "'%s' needs a number", key);
+        return min;
     }
+    memcpy(buf, val, len);
+    buf[len] = '\0';
+    long v = strtol(buf, &end, 10);
+    if (*end != '\0' || v < min || v > max) {
+        parse_error(ps, ps->line, "'%s' must be a number from %ld to %ld", key, min, max);
+        return min;
+    }
+    return v;
+}
 
-    if (strncmp(key, "part_", 5) == 0 && buffered_concat.name[0]) {
-        int idx = atoi(key + 5);
-        if (idx >= 0 && idx < MAX_PARTS) {
-            strncpy(buffered_concat.part_name[idx], value, MAX_NAME_LEN-1);
-            buffered_concat.part_name[idx][MAX_NAME_LEN-1] = '\0';
-            collected_parts++;
+// a byte count with an optional K, M or G suffix
+static size_t parse_size(Parser *ps, const char *key, const char *val, size_t len) {
+    size_t shift = 0;
+    if (len > 0) {
+        switch (val[len - 1]) {
+        case 'K': case 'k': shift = 10; break;
+        case 'M': case 'm': shift = 20; break;
+        case 'G': case 'g': shift = 30; break;
         }
     }
-
-    return 0;
+    if (shift) len--;
+    long v = parse_number(ps, key, val, len, 1, LONG_MAX >> shift);
+    return (size_t)v << shift;
 }
 
-/* PROCESS CREATOR / EXECUTOR */
-
-int run_pipe(const char *leftCmd, const char *rightCmd) {
-    // fd[0] - read end of the pipe
-    // fd[1] - write end of the pipe
-    int fd[2];
-
-    if (pipe(fd) <  0) { 
-        perror("error on pipe"); 
-        return -1; 
+// a CPU list like 0,2-3 for cpus=
+static void parse_cpus(Parser *ps, cpu_set_t *set, const char *val, size_t len) {
+    char buf[256];
+    if (len == 0 || len >= sizeof buf) {
+        parse_error(ps, ps->line, "'cpus' needs a list like 0,2-3");
+        return;
     }
-
-    pid_t c1 = fork();
-
-    // if it's the child process, make this one the producer
-    if (c1 == -1) { 
-        perror("error on c1 fork"); 
-        close(fd[0]); 
-        close(fd[1]); 
-        return -1; 
+    memcpy(buf, val, len);
+    buf[len] = '\0';
+
+    CPU_ZERO(set);
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long lo = strtol(tok, &end, 10), hi = lo;
+        if (end != tok && *end == '-') hi = strtol(end + 1, &end, 10);
+        if (end == tok || *end != '\0' || lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+            parse_error(ps, ps->line, "'cpus' has a bad entry '%s'", tok);
+            return;
+        }
+        for (long c = lo; c <= hi; c++) CPU_SET((int)c, set);
     }
+}
 
-    if (c1 == 0) {
-        // redirect the stdout of this process into the write end of the pipe
-        dup2(fd[1], STDOUT_FILENO);
-        close(fd[0]); // don't need read end
-        close(fd[1]); // close original write end
+// seconds, fractions allowed, for timeout=
+static double parse_seconds(Parser *ps, const char *key, const char *val, size_t len) {
+    char buf[32];
+    char *end = NULL;
+    if (len == 0 || len >= sizeof buf) {
+        parse_error(ps, ps->line, "'%s' needs a number of seconds", key);
+        return 0;
+    }
+    memcpy(buf, val, len);
+    buf[len] = '\0';
+    double v = strtod(buf, &end);
+    if (*end != '\0' || !(v > 0) || v > 1e9) {
+        parse_error(ps, ps->line, "'%s' must be a positive number of seconds", key);
+        return 0;
+    }
+    return v;
+}
 
-        // run as shell- lets us not have to write a parser for this
-        execlp("sh", "sh", "-c", leftCmd, (char*)0);
-        perror("error executing left command");
-        _exit(127);
+// builtin=wc | wc -l | wc -w | wc -c | sub A B | head N | tail N | grep TEXT
+static void parse_builtin(Parser *ps, Node *n, const char *val, size_t len) {
+    if (n->command[0]) {
+        parse_error(ps, ps->line, "node '%s' has both command= and builtin=", n->name);
+        return;
+    }
+    set_field(ps, n->command, CMD_LEN, "builtin", val, len);
+    if (!n->command[0]) return;
+
+    char spec[CMD_LEN];
+    strcpy(spec, n->command);
+    char *save = NULL;
+    char *op = strtok_r(spec, " ", &save);
+    char *a = strtok_r(NULL, " ", &save);
+    char *rest = save && *save ? save : NULL;
+
+    if (op && strcmp(op, "wc") == 0 && !rest) {
+        if (!a) n->builtin = BUILTIN_WC;
+        else if (strcmp(a, "-l") == 0) n->builtin = BUILTIN_WC_L;
+        else if (strcmp(a, "-w") == 0) n->builtin = BUILTIN_WC_W;
+        else if (strcmp(a, "-c") == 0) n->builtin = BUILTIN_WC_C;
+    } else if (op && (strcmp(op, "head") == 0 || strcmp(op, "tail") == 0) && a && !rest) {
+        n->builtin = op[0] == 'h' ? BUILTIN_HEAD : BUILTIN_TAIL;
+        n->builtin_n = parse_number(ps, op, a, strlen(a), 0, LONG_MAX);
+    } else if (op && strcmp(op, "sub") == 0 && a) {
+        n->builtin = BUILTIN_SUB;
+        if (rest && strchr(rest, ' ')) n->builtin = BUILTIN_NONE;
+        set_field(ps, n->pattern, MAX_NAME_LEN, "sub text", a, strlen(a));
+        if (rest) set_field(ps, n->replacement, MAX_NAME_LEN, "sub replacement", rest, strlen(rest));
+    } else if (op && strcmp(op, "grep") == 0 && a) {
+        // everything after "grep " is the text, spaces included
+        n->builtin = BUILTIN_GREP;
+        const char *text = n->command + 5;
+        set_field(ps, n->pattern, MAX_NAME_LEN, "grep text", text, strlen(text));
     }
+    if (n->builtin == BUILTIN_NONE) {
+        parse_error(ps, ps->line, "unknown builtin '%s'", n->command);
+    }
+}
 
-    pid_t c2 = fork();
+// part_N for a concatenate or tee
+static void set_part(Parser *ps, char part_name[MAX_PARTS][MAX_NAME_LEN], const char *key, size_t klen,
+                     const char *val, size_t vlen) {
+    int errors = ps->errors;
+    long idx = parse_number(ps, "part_N", key + 5, klen - 5, 0, MAX_PARTS - 1);
+    if (ps->errors != errors) return;
 
-    if (c2 == -1) { 
-        perror("error on c2 fork"); 
-        close(fd[0]); 
-        close(fd[1]); 
-        return -1; 
+    char k[MAX_NAME_LEN];
+    snprintf(k, sizeof k, "%.*s", (int)klen, key);
+    set_field(ps, part_name[idx], MAX_NAME_LEN, k, val, vlen);
+}
+
+// check that parts=N was given and part_0 .. part_{N-1} are all there
+static void check_parts(Parser *ps, const char *name, int parts, char part_name[MAX_PARTS][MAX_NAME_LEN]) {
+    if (parts <= 0) {
+        parse_error(ps, ps->start, "'%s' has no parts=", name);
+        return;
     }
-    
-    // and this one the consumer
-    if (c2 == 0) {
-        // redirect the stdin of this process into the read end of the pipe
-        // i.e., this will read from the pipe
-        dup2(fd[0], STDIN_FILENO);
-        close(fd[1]); // ditto above
-        close(fd[0]);
-        execlp("sh", "sh", "-c", rightCmd, (char*)0);
-        perror("error executing right command");
-        _exit(127);
+    for (int i = 0; i < MAX_PARTS; i++) {
+        if (i < parts && !part_name[i][0]) parse_error(ps, ps->start, "'%s' is missing part_%d", name, i);
+        if (i >= parts && part_name[i][0]) parse_error(ps, ps->start, "'%s' has part_%d but parts=%d", name, i, parts);
     }
+}
 
-    close(fd[0]);
-    close(fd[1]);
-
-    int status;
+// the open component is done: make sure it has everything it needs
+static void close_component(Parser *ps) {
+    if (!ps->open) return;
+    ps->open = 0;
+
+    switch (ps->kind) {
+    case KIND_NODE: {
+        Node *n = &node_array[ps->index];
+        if (is_file_node(n)) {
+            const char *what = n->builtin == BUILTIN_SOURCE ? "source" : "sink";
+            if (!n->path[0]) { parse_error(ps, ps->start, "%s '%s' has no path=", what, n->name); break; }
+            // the command shows up in traces and signatures; the file is what
+            // -i checks, as an input of a source and an output of a sink
+            snprintf(n->command, CMD_LEN, "%s %s%s", what, n->path, n->append ? " (append)" : "");
+            if (!strchr(n->path, ' ')) strcpy(n->builtin == BUILTIN_SOURCE ? n->inputs : n->outputs, n->path);
+            break;
+        }
+        if (!n->command[0]) parse_error(ps, ps->start, "node '%s' has no command=", n->name);
+        if (n->builtin && (n->has_cpus || n->nice || n->memory || n->timeout > 0)) {
+            parse_error(ps, ps->start, "builtin node '%s' runs inside the interpreter, so it can't take cpus=, nice=, memory= or timeout=", n->name);
+        }
+        break;
+    }
+    case KIND_PIPE: {
+        const Pipe *p = &pipe_array[ps->index];
+        if (!p->from[0]) parse_error(ps, ps->start, "pipe '%s' has no from=", p->name);
+        if (!p->to[0]) parse_error(ps, ps->start, "pipe '%s' has no to=", p->name);
+        break;
+    }
+    case KIND_CONCAT: {
+        Concat *c = &concat_array[ps->index];
+        check_parts(ps, c->name, c->parts, c->part_name);
+        break;
+    }
+    case KIND_STDERR: {
+        const Stderr *sd = &stderr_array[ps->index];
+        if (!sd->from_node[0]) parse_error(ps, ps->start, "stderr '%s' has no from=", sd->name);
+        break;
+    }
+    case KIND_TEE: {
+        Tee *t = &tee_array[ps->index];
+        if (!t->from[0]) parse_error(ps, ps->start, "tee '%s' has no from=", t->name);
+        check_parts(ps, t->name, t->parts, t->part_name);
+        break;
+    }
+    case KIND_PARALLEL: {
+        const Parallel *par = &parallel_array[ps->index];
+        if (!par->from[0]) parse_error(ps, ps->start, "parallel '%s' has no from=", par->name);
+        if (!par->worker[0]) parse_error(ps, ps->start, "parallel '%s' has no worker=", par->name);
+        break;
+    }
+    case KIND_STREAMS: {
+        const Streams *st = &streams_array[ps->index];
+        if (!st->from[0]) parse_error(ps, ps->start, "streams '%s' has no from=", st->name);
+        if (!st->out[0] && !st->err[0]) parse_error(ps, ps->start, "streams '%s' needs out= or err=", st->name);
+        break;
+    }
+    }
+}
 
-    waitpid(c1, NULL, 0);
-    waitpid(c2, &status, 0);
+// start a new component of the given kind
+static void open_component(Parser *ps, Kind kind, const char *val, size_t len) {
+    close_component(ps);
+
+    char name[MAX_NAME_LEN] = {0};
+    set_field(ps, name, sizeof name, kind_names[kind], val, len);
+    ps->skipping = !name[0];
+    if (ps->skipping) return;
+
+    int index = 0;
+    char *name_field = NULL;
+    switch (kind) {
+    case KIND_NODE:
+        node_array = grow_array(node_array, node_count, &node_cap, sizeof *node_array);
+        index = node_count++;
+        memset(&node_array[index], 0, sizeof *node_array);
+        name_field = node_array[index].name;
+        node_array[index].line = ps->line;
+        break;
+    case KIND_PIPE:
+        pipe_array = grow_array(pipe_array, pipe_count, &pipe_cap, sizeof *pipe_array);
+        index = pipe_count++;
+        memset(&pipe_array[index], 0, sizeof *pipe_array);
+        name_field = pipe_array[index].name;
+        pipe_array[index].line = ps->line;
+        break;
+    case KIND_CONCAT:
+        concat_array = grow_array(concat_array, concat_count, &concat_cap, sizeof *concat_array);
+        index = concat_count++;
+        memset(&concat_array[index], 0, sizeof *concat_array);
+        name_field = concat_array[index].name;
+        concat_array[index].line = ps->line;
+        break;
+    case KIND_STDERR:
+        stderr_array = grow_array(stderr_array, stderr_count, &stderr_cap, sizeof *stderr_array);
+        index = stderr_count++;
+        memset(&stderr_array[index], 0, sizeof *stderr_array);
+        name_field = stderr_array[index].name;
+        stderr_array[index].line = ps->line;
+        break;
+    case KIND_TEE:
+        tee_array = grow_array(tee_array, tee_count, &tee_cap, sizeof *tee_array);
+        index = tee_count++;
+        memset(&tee_array[index], 0, sizeof *tee_array);
+        name_field = tee_array[index].name;
+        tee_array[index].line = ps->line;
+        break;
+    case KIND_PARALLEL:
+        parallel_array = grow_array(parallel_array, parallel_count, &parallel_cap, sizeof *parallel_array);
+        index = parallel_count++;
+        memset(&parallel_array[index], 0, sizeof *parallel_array);
+        name_field = parallel_array[index].name;
+        parallel_array[index].line = ps->line;
+        parallel_array[index].chunk = PAR_CHUNK;
+        break;
+    case KIND_STREAMS:
+        streams_array = grow_array(streams_array, streams_count, &streams_cap, sizeof *streams_array);
+        index = streams_count++;
+        memset(&streams_array[index], 0, sizeof *streams_array);
+        name_field = streams_array[index].name;
+        streams_array[index].line = ps->line;
+        break;
+    }
+    strcpy(name_field, name);
 
-    if (WIFEXITED(status)) {
-        return WEXITSTATUS(status);
+    const Symbol *prev = add_symbol(name, kind, index, ps->line);
+    if (prev) {
+        parse_error(ps, ps->line, "'%s' is already defined as a %s on line %d", name, kind_names[prev->kind], prev->line);
     }
 
-    return -1;
+    ps->open = 1;
+    ps->kind = kind;
+    ps->index = index;
+    ps->start = ps->line;
 }
 
-// Run a node so that its STDOUT goes to out_fd
-static int run_node_into_fd(const Node *n, int out_fd) {
-    pid_t c = fork();
-    if (c == 0) {
-        if (dup2(out_fd, STDOUT_FILENO) < 0) { 
-            perror("dup2"); 
-            _exit(127); 
-        }
-        execlp("sh", "sh", "-c", n->command, (char*)0);
-        perror("exec node");
-        _exit(127);
-    }
-    int st=0; waitpid(c,&st,0);
-    return (WIFEXITED(st)? WEXITSTATUS(st) : -1);
+// source= and sink= are nodes whose builtin is a file, so they go wherever a node can
+static void open_file_node(Parser *ps, int builtin, const char *val, size_t len) {
+    open_component(ps, KIND_NODE, val, len);
+    if (!ps->skipping) node_array[ps->index].builtin = builtin;
 }
 
-// Run STDERR of a node into out_fd (and silence its normal stdout)
-static int run_stderr_into_fd(const Stderr *sd, int out_fd) {
-    const Node *n = get_node_by_name(node_array, node_count, sd->from_node);
-    if (!n) { 
-        fprintf(stderr,"stderr from unknown node '%s'\n", sd->from_node); 
-        return -1; 
+#define KEY_IS(k) (klen == sizeof(k) - 1 && memcmp(key, k, klen) == 0)
+
+// apply one key=value line to the open component
+static void parse_setting(Parser *ps, const char *key, size_t klen, const char *val, size_t vlen) {
+    char k[MAX_NAME_LEN];
+    snprintf(k, sizeof k, "%.*s", (int)klen, key);
+
+    if (ps->skipping) return;
+    if (!ps->open) {
+        parse_error(ps, ps->line, "'%s' is not inside a component", k);
+        return;
     }
 
-    pid_t c = fork();
-    if (c == 0) {
-        // redirect this child's STDERR to out_fd
-        if (dup2(out_fd, STDERR_FILENO) < 0) {
-             perror("dup2 err"); 
-             _exit(127); 
+    int known = 1;
+    switch (ps->kind) {
+    case KIND_NODE: {
+        Node *n = &node_array[ps->index];
+        if (is_file_node(n)) {
+            if (KEY_IS("path")) set_field(ps, n->path, sizeof n->path, k, val, vlen);
+            else if (KEY_IS("append") && n->builtin == BUILTIN_SINK) n->append = (int)parse_number(ps, k, val, vlen, 0, 1);
+            else parse_error(ps, ps->line, "'%s' is not a %s setting", k, n->builtin == BUILTIN_SOURCE ? "source" : "sink");
+            break;
         }
-
-        // silence its STDOUT so it doesn't mix with errors
-        int devnull = open("/dev/null", O_WRONLY);
-        if (devnull >= 0) {
-            dup2(devnull, STDOUT_FILENO);
-            close(devnull);
+        if (KEY_IS("command") && n->builtin) parse_error(ps, ps->line, "node '%s' has both command= and builtin=", n->name);
+        else if (KEY_IS("command")) set_field(ps, n->command, CMD_LEN, k, val, vlen);
+        else if (KEY_IS("builtin")) parse_builtin(ps, n, val, vlen);
+        else if (KEY_IS("cache")) n->cacheable = (int)parse_number(ps, k, val, vlen, 0, 1);
+        else if (KEY_IS("inputs")) set_field(ps, n->inputs, CMD_LEN, k, val, vlen);
+        else if (KEY_IS("outputs")) set_field(ps, n->outputs, CMD_LEN, k, val, vlen);
+        else if (KEY_IS("cpus")) { parse_cpus(ps, &n->cpus, val, vlen); n->has_cpus = 1; }
+        else if (KEY_IS("nice")) n->nice = (int)parse_number(ps, k, val, vlen, -20, 19);
+        else if (KEY_IS("memory")) n->memory = parse_size(ps, k, val, vlen);
+        else if (KEY_IS("timeout")) n->timeout = parse_seconds(ps, k, val, vlen);
+        else known = 0;
+        break;
+    }
+    case KIND_PIPE: {
+        Pipe *p = &pipe_array[ps->index];
+        if (KEY_IS("from")) set_field(ps, p->from, MAX_NAME_LEN, k, val, vlen);
+        else if (KEY_IS("to")) set_field(ps, p->to, MAX_NAME_LEN, k, val, vlen);
+        else if (KEY_IS("buffer")) p->buffer = parse_size(ps, k, val, vlen);
+        else if (KEY_IS("ring")) p->ring = parse_size(ps, k, val, vlen);
+        else if (KEY_IS("checkpoint")) p->checkpoint = (int)parse_number(ps, k, val, vlen, 0, 1);
+        else if (KEY_IS("transport")) {
+            if (vlen == 3 && memcmp(val, "shm", 3) == 0) p->shm = 1;
+            else if (vlen == 4 && memcmp(val, "pipe", 4) == 0) p->shm = 0;
+            else parse_error(ps, ps->line, "'transport' must be pipe or shm");
+        }
+        else known = 0;
+        break;
+    }
+    case KIND_CONCAT: {
+        Concat *c = &concat_array[ps->index];
+        if (KEY_IS("parts")) c->parts = (int)parse_number(ps, k, val, vlen, 1, MAX_PARTS);
+        else if (klen > 5 && memcmp(key, "part_", 5) == 0) set_part(ps, c->part_name, key, klen, val, vlen);
+        else known = 0;
+        break;
+    }
+    case KIND_STDERR: {
+        Stderr *sd = &stderr_array[ps->index];
+        if (KEY_IS("from")) set_field(ps, sd->from_node, MAX_NAME_LEN, k, val, vlen);
+        else known = 0;
+        break;
+    }
+    case KIND_TEE: {
+        Tee *t = &tee_array[ps->index];
+        if (KEY_IS("from")) set_field(ps, t->from, MAX_NAME_LEN, k, val, vlen);
+        else if (KEY_IS("parts")) t->parts = (int)parse_number(ps, k, val, vlen, 1, MAX_PARTS);
+        else if (klen > 5 && memcmp(key, "part_", 5) == 0) set_part(ps, t->part_name, key, klen, val, vlen);
+        else known = 0;
+        break;
+    }
+    case KIND_PARALLEL: {
+        Parallel *par = &parallel_array[ps->index];
+        if (KEY_IS("from")) set_field(ps, par->from, MAX_NAME_LEN, k, val, vlen);
+        else if (KEY_IS("worker")) set_field(ps, par->worker, MAX_NAME_LEN, k, val, vlen);
+        else if (KEY_IS("workers")) par->workers = (int)parse_number(ps, k, val, vlen, 0, MAX_WORKERS);
+        else if (KEY_IS("chunk")) par->chunk = (size_t)parse_number(ps, k, val, vlen, 1, LONG_MAX);
+        else if (KEY_IS("ordered")) par->unordered = !parse_number(ps, k, val, vlen, 0, 1);
+        else if (KEY_IS("split")) {
+            if (vlen == 5 && memcmp(val, "bytes", 5) == 0) par->split_bytes = 1;
+            else if (vlen == 4 && memcmp(val, "line", 4) == 0) par->split_bytes = 0;
+            else parse_error(ps, ps->line, "'split' must be 'line' or 'bytes'");
         }
+        else known = 0;
+        break;
+    }
+    case KIND_STREAMS: {
+        Streams *st = &streams_array[ps->index];
+        if (KEY_IS("from")) set_field(ps, st->from, MAX_NAME_LEN, k, val, vlen);
+        else if (KEY_IS("out")) set_field(ps, st->out, MAX_NAME_LEN, k, val, vlen);
+        else if (KEY_IS("err")) set_field(ps, st->err, MAX_NAME_LEN, k, val, vlen);
+        else known = 0;
+        break;
+    }
+    }
 
-        execlp("sh", "sh", "-c", n->command, (char*)0);
-        perror("exec stderr-from");
-        _exit(127);
+    if (!known) {
+        parse_error(ps, ps->line, "'%s' is not a %s setting", k, kind_names[ps->kind]);
     }
-    int st=0; waitpid(c,&st,0);
-    return (WIFEXITED(st)? WEXITSTATUS(st) : -1);
 }
 
-// Run a pipe and send the RIGHT side's STDOUT into out_fd
-static int run_pipe_into_fd(const Pipe *p, int out_fd) {
-    // set up the inner ls|wc, but make wc's stdout go to out_fd
-    int fd[2]; if (pipe(fd) < 0) { 
-        perror("pipe"); 
-        return -1; 
-    }
+// parse a whole flow file held in memory, in one pass
+static int parse_flow(const char *path, const char *buf, size_t len) {
+    Parser ps = { .path = path };
+    const char *end = buf + len;
+
+    for (const char *p = buf; p < end; ) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *eol = nl ? nl : end;
+        const char *next = nl ? nl + 1 : end;
+        ps.line++;
+
+        if (eol > p && eol[-1] == '\r') eol--;
+        if (eol == p || *p == '#') { p = next; continue; }
+
+        const char *eq = memchr(p, '=', (size_t)(eol - p));
+        if (!eq || eq == p) {
+            parse_error(&ps, ps.line, "expected key=value");
+            p = next;
+            continue;
+        }
 
-    const Node *from = get_node_by_name(node_array, node_count, p->from);
-    const Node *to = get_node_by_name(node_array, node_count, p->to);
+        const char *key = p, *val = eq + 1;
+        size_t klen = (size_t)(eq - p), vlen = (size_t)(eol - val);
 
-    if (!from || !to) { 
-        fprintf(stderr,"bad pipe endpoints\n"); 
-        close(fd[0]); 
-        close(fd[1]); 
-        return -1; 
+        int kind = -1;
+        for (int i = 0; i < (int)(sizeof kind_names / sizeof kind_names[0]); i++) {
+            if (klen == strlen(kind_names[i]) && memcmp(key, kind_names[i], klen) == 0) kind = i;
+        }
+        if (kind >= 0) open_component(&ps, (Kind)kind, val, vlen);
+        else if (klen == 6 && memcmp(key, "source", 6) == 0) open_file_node(&ps, BUILTIN_SOURCE, val, vlen);
+        else if (klen == 4 && memcmp(key, "sink", 4) == 0) open_file_node(&ps, BUILTIN_SINK, val, vlen);
+        else parse_setting(&ps, key, klen, val, vlen);
+
+        p = next;
     }
+    close_component(&ps);
+    return ps.errors;
+}
 
-    pid_t c1 = fork();
-    if (c1 == 0) { // producer
-        dup2(fd[1], STDOUT_FILENO);
-        close(fd[0]); close(fd[1]);
-        execlp("sh","sh","-c", from->command, (char*)0);
-        perror("exec left"); _exit(127);
+// check every reference resolves to a component that can be used there, and that
+// nothing depends on itself; runs before anything is forked
+static int validate_flow(const char *path) {
+    int errors = 0;
+
+    for (int i = 0; i < symbol_count; i++) {
+        const Symbol *s = &symbols[i];
+        const char *refs[MAX_PARTS + 1];
+        int n = component_refs(s, refs);
+        for (int r = 0; r < n; r++) {
+            const Symbol *t = lookup(refs[r]);
+            if (!t) {
+                fprintf(stderr, "%s:%d: %s '%s' refers to unknown component '%s'\n",
+                        path, s->line, kind_names[s->kind], s->name, refs[r]);
+                errors++;
+            } else if (s->kind == KIND_STDERR && t->kind != KIND_NODE) {
+                fprintf(stderr, "%s:%d: stderr '%s' must read from a node, '%s' is a %s\n",
+                        path, s->line, s->name, refs[r], kind_names[t->kind]);
+                errors++;
+            } else if (s->kind == KIND_STREAMS && t->kind != KIND_NODE) {
+                fprintf(stderr, "%s:%d: streams '%s' only connects nodes, '%s' is a %s\n",
+                        path, s->line, s->name, refs[r], kind_names[t->kind]);
+                errors++;
+            } else if (s->kind == KIND_PIPE && r == 1 && t->kind != KIND_NODE) {
+                fprintf(stderr, "%s:%d: pipe '%s' must send to a node, '%s' is a %s\n",
+                        path, s->line, s->name, refs[r], kind_names[t->kind]);
+                errors++;
+            }
+        }
+    }
+    if (errors) return errors;
+
+    // depth-first search without recursion, so long chains can't overflow the stack
+    enum { WHITE, GREY, BLACK };
+    unsigned char *color = calloc((size_t)symbol_count, 1);
+    int *stack = malloc((size_t)symbol_count * 2 * sizeof *stack);
+    if (symbol_count && (!color || !stack)) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
     }
 
-    pid_t c2 = fork();
-    if (c2 == 0) { // consumer
-        dup2(fd[0], STDIN_FILENO);
-        close(fd[1]); close(fd[0]);
-        // redirect consumer's stdout to out_fd
-        if (dup2(out_fd, STDOUT_FILENO) < 0) { perror("dup2 out"); _exit(127); }
-        execlp("sh","sh","-c", to->command, (char*)0);
-        perror("exec right"); _exit(127);
+    for (int root = 0; root < symbol_count; root++) {
+        if (color[root] != WHITE) continue;
+        int sp = 0;
+        stack[sp++] = root; stack[sp++] = 0;
+        color[root] = GREY;
+
+        while (sp > 0) {
+            int cur = stack[sp - 2];
+            int next_ref = stack[sp - 1];
+            const char *refs[MAX_PARTS + 1];
+            int n = component_refs(&symbols[cur], refs);
+
+            if (next_ref >= n) {
+                color[cur] = BLACK;
+                sp -= 2;
+                continue;
+            }
+            stack[sp - 1]++;
+
+            int dep = (int)(lookup(refs[next_ref]) - symbols);
+            if (color[dep] == GREY) {
+                fprintf(stderr, "%s:%d: '%s' depends on itself through '%s'\n",
+                        path, symbols[dep].line, symbols[dep].name, symbols[cur].name);
+                errors++;
+            } else if (color[dep] == WHITE) {
+                color[dep] = GREY;
+                stack[sp++] = dep; stack[sp++] = 0;
+            }
+        }
     }
 
-    close(fd[0]); close(fd[1]);
-    int st; waitpid(c1,NULL,0); waitpid(c2,&st,0);
-    return (WIFEXITED(st)? WEXITSTATUS(st) : -1);
+    free(color);
+    free(stack);
+    return errors;
 }
 
-// run a concatenate by sequentially running each part into out_fd
-static int run_concat_into_fd(const Concat *c, int out_fd) {
-    for (int i = 0; i < c->parts; i++) {
-        const char *name = c->part_name[i];
-        if (!name[0]) continue; // skip holes if parts came out-of-order in file
+// write() until all of buf is out or the fd fails
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) return -1;
+        buf += w; len -= (size_t)w;
+    }
+    return 0;
+}
 
-        // dispatch by kind (node, pipe, concatenate, stderr)
-        if (get_node_by_name(node_array, node_count, name)) {
-            int rc = run_node_into_fd(get_node_by_name(node_array, node_count, name), out_fd);
-            if (rc != 0) return rc;
-        } else if (get_pipe_by_name(pipe_array, pipe_count, name)) {
-            int rc = run_pipe_into_fd(get_pipe_by_name(pipe_array, pipe_count, name), out_fd);
-            if (rc != 0) return rc;
-        } else if (get_concat_by_name(concat_array, concat_count, name)) {
-            int rc = run_concat_into_fd(get_concat_by_name(concat_array, concat_count, name), out_fd);
-            if (rc != 0) return rc;
-        } else if (get_stderr_by_name(stderr_array, stderr_count, name)) {
-            int rc = run_stderr_into_fd(get_stderr_by_name(stderr_array, stderr_count, name), out_fd);
-            if (rc != 0) return rc;
-        } else {
-            fprintf(stderr,"unknown component '%s' in concatenate '%s'\n", name, c->name);
-            return -1;
-        }
+// -b sets the capacity of the pipes between stages that don't pick their own
+static size_t pipe_buffer = 0;
+
+// pipe() with its capacity set to size bytes (or the -b default). The kernel rounds
+// up to a power-of-two number of pages and caps unprivileged users at
+// /proc/sys/fs/pipe-max-size, so a refused size only warns.
+static int open_pipe(int fd[2], size_t size) {
+    if (pipe(fd) < 0) return -1;
+    if (size == 0) size = pipe_buffer;
+    if (size > 0 && fcntl(fd[1], F_SETPIPE_SZ, size > INT_MAX ? INT_MAX : (int)size) < 0) {
+        static int warned = 0;
+        if (!warned++) fprintf(stderr, "can't set pipe buffer to %zu bytes: %s\n", size, strerror(errno));
     }
     return 0;
 }
 
-/* DRIVER */
+/* TRACING */
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "usage: %s <flowfile>\n", argv[0]);
-        return 1;
-    }
+// -t <file> turns this on; every process appends its own events with a single
+// O_APPEND write, so children forked at any depth can report without coordination
+static int trace_fd = -1;
+static pid_t trace_pid;
+static struct timespec trace_epoch;
 
-    // open .flow
-    FILE *f = fopen(argv[1], "r");
+static double trace_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - trace_epoch.tv_sec) * 1e6 + (ts.tv_nsec - trace_epoch.tv_nsec) / 1e3;
+}
 
-    if (f == NULL) {
-        fprintf(stderr, "unable to open file");
-        return 1;
+// copy src into dst as the inside of a JSON string
+static void json_escape(char *dst, size_t cap, const char *src) {
+    size_t o = 0;
+    for (; *src && o + 7 < cap; src++) {
+        unsigned char ch = (unsigned char)*src;
+        if (ch == '"' || ch == '\\') { dst[o++] = '\\'; dst[o++] = (char)ch; }
+        else if (ch < 0x20) o += (size_t)snprintf(dst + o, cap - o, "\\u%04x", ch);
+        else dst[o++] = (char)ch;
     }
+    dst[o] = '\0';
+}
 
-    char buffer[LINE_LEN];
+static void trace_event(const char *fmt, ...) {
+    if (trace_fd < 0) return;
+    char buf[4096];
+    buf[0] = ','; buf[1] = '\n';
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf + 2, sizeof buf - 2, fmt, ap);
+    va_end(ap);
+    if (len < 0) return;
+    if ((size_t)len > sizeof buf - 3) len = (int)sizeof buf - 3;
+    if (write(trace_fd, buf, (size_t)len + 2) < 0) { /* tracing is best effort */ }
+}
 
-    while (fgets(buffer, LINE_LEN, f)) {
-        parse_line(buffer);
+static int trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) { perror(path); return -1; }
+    trace_pid = getpid();
+    clock_gettime(CLOCK_MONOTONIC, &trace_epoch);
+    dprintf(trace_fd, "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"flow\"}}", trace_pid);
+    return 0;
+}
 
-        if (node_is_complete(&buffered_node)) {
-            // we have both; finalize the node by copying to array and clearing the buffer
-            if (node_count >= MAX_NODES) {
-                fprintf(stderr,"too many nodes\n"); break; 
-            }
-            node_array[node_count] = buffered_node;
-            memset(&buffered_node, 0, sizeof buffered_node);
-            node_count++;
-        }
+static void trace_close(void) {
+    if (trace_fd < 0) return;
+    if (write(trace_fd, "\n]\n", 3) < 0) { /* best effort */ }
+    close(trace_fd);
+    trace_fd = -1;
+}
 
-        if (pipe_is_complete(&buffered_pipe)) {
-            if (pipe_count >= MAX_PIPES) { 
-                fprintf(stderr,"too many pipes\n"); break; 
-            }
-            pipe_array[pipe_count] = buffered_pipe;
-            memset(&buffered_pipe, 0, sizeof buffered_pipe);
-            pipe_count++;
-        }
+// record an in-interpreter span (concatenate, tee, parallel) that began at start_us
+static void trace_span(const char *kind, const char *name, double start_us, const char *extra) {
+    if (trace_fd < 0) return;
+    char ename[2 * MAX_NAME_LEN];
+    json_escape(ename, sizeof ename, name);
+    trace_event("{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.0f,\"dur\":%.0f,\"args\":{%s}}",
+                ename, kind, trace_pid, getpid(), start_us, trace_now_us() - start_us, extra ? extra : "");
+}
 
-        // finalize stderr
-        if (stderr_is_complete(&buffered_stderr)) {
-            if (stderr_count < MAX_CONCATS) {
-                stderr_array[stderr_count++] = buffered_stderr;
-                memset(&buffered_stderr, 0, sizeof buffered_stderr);
-            }
-        }
+// waitpid() for a child started at start_us; with tracing on, also records its
+// wall/user/sys time and peak RSS from wait4()
+static int wait_traced(pid_t pid, const char *name, const char *command, double start_us) {
+    int st = 0;
+    struct rusage ru;
+    memset(&ru, 0, sizeof ru);
+    while (wait4(pid, &st, 0, &ru) < 0 && errno == EINTR) {}
+    if (trace_fd < 0) return st;
+
+    char ename[2 * MAX_NAME_LEN], ecmd[2 * CMD_LEN];
+    json_escape(ename, sizeof ename, name);
+    json_escape(ecmd, sizeof ecmd, command ? command : "");
+    trace_event("{\"name\":\"%s\",\"cat\":\"process\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%.0f,\"dur\":%.0f,\"args\":{\"command\":\"%s\",\"exit\":%d,"
+                "\"user_ms\":%.3f,\"sys_ms\":%.3f,\"max_rss_kb\":%ld}}",
+                ename, trace_pid, pid, start_us, trace_now_us() - start_us, ecmd,
+                WIFEXITED(st) ? WEXITSTATUS(st) : -1,
+                ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3,
+                ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3,
+                ru.ru_maxrss);
+    return st;
+}
 
-        // finalize concatenate
-        if (buffered_concat.name[0] && expected_parts > 0 && collected_parts >= expected_parts) {
-            buffered_concat.parts = expected_parts;
-            if (concat_count < MAX_CONCATS) {
-                concat_array[concat_count++] = buffered_concat;
-                memset(&buffered_concat, 0, sizeof buffered_concat);
-                expected_parts = collected_parts = 0;
+// With tracing on, put a counting relay in front of *write_fd: the caller's producer
+// writes into a new pipe and a child splices it on to the original fd, recording how
+// many bytes went through. Returns the relay's pid, or 0 when tracing is off.
+// The caller closes the returned *write_fd once the producer has it. reader_fd is
+// the read end of the caller's pipe (or -1); the relay must not hold it, or a
+// consumer that quits early would never make the relay see EPIPE.
+static pid_t trace_relay(const char *label, int *write_fd, int reader_fd) {
+    if (trace_fd < 0) return 0;
+
+    int r[2];
+    if (open_pipe(r, 0) < 0) { perror("pipe"); return 0; }
+
+    double start = trace_now_us();
+    pid_t c = fork();
+    if (c < 0) { perror("fork relay"); close(r[0]); close(r[1]); return 0; }
+    if (c == 0) {
+        signal(SIGPIPE, SIG_IGN); // a consumer that quits early just ends the count
+        close(r[1]);
+        if (reader_fd >= 0) close(reader_fd);
+        long long bytes = 0;
+        for (;;) {
+            ssize_t m = splice(r[0], NULL, *write_fd, NULL, TEE_CHUNK, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0 && errno == EINVAL) { // destination can't take splice(); copy instead
+                char buf[TEE_CHUNK];
+                m = read(r[0], buf, sizeof buf);
+                if (m > 0 && write_all(*write_fd, buf, (size_t)m) < 0) m = -1;
             }
+            if (m <= 0) break;
+            bytes += m;
         }
+        char extra[64];
+        snprintf(extra, sizeof extra, "\"bytes\":%lld", bytes);
+        trace_span("pipe", label, start, extra);
+        _exit(0);
     }
+    close(r[0]);
+    *write_fd = r[1];
+    return c;
+}
 
-    fclose(f);
+/* SHARED-MEMORY RINGS */
 
-    if (argv[1] == NULL) {
-        fprintf(stderr, "usage: <flowfile> %s <pipe_name>\n", argv[1]);
-        return 1;
-    }
+// With transport=shm, builtins that feed each other pass data through a
+// single-producer single-consumer ring in a MAP_SHARED mapping instead of a kernel
+// pipe: one copy in and one copy out, and no syscall at all while neither side
+// has to wait. head and tail only grow; the byte at position i lives at
+// data[i & (size - 1)]. A side that has to wait sleeps on a futex sequence word
+// the other side bumps after every update, and is only woken if it said it was
+// waiting.
 
-    const char *pipeName = argv[2];
+#define SHM_RING_SIZE (1024 * 1024)
 
-    printf("Pipe Name: %s", pipeName);
+typedef struct {
+    // written by the producer
+    uint64_t head;              // bytes written so far
+    uint32_t data_seq;          // bumped after each write and on close
+    uint32_t writer_waiting;
+    uint32_t writer_closed;
+    char pad1[64 - 20];
+    // written by the consumer
+    uint64_t tail;              // bytes read so far
+    uint32_t space_seq;         // bumped after each read and on close
+    uint32_t reader_waiting;
+    uint32_t reader_closed;
+    char pad2[64 - 20];
+    size_t size;                // a power of two
+    size_t map_len;
+    char pad3[64 - 2 * sizeof(size_t)];
+    char data[];
+} ShmRing;
+
+static void futex_wait(uint32_t *word, uint32_t val) {
+    syscall(SYS_futex, word, FUTEX_WAIT, val, NULL, NULL, 0);
+}
 
-    const Pipe *target_pipe = get_pipe_by_name(pipe_array, pipe_count, pipeName);
+static void futex_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static ShmRing *shm_ring_open(size_t want) {
+    size_t size = 4096;
+    while (size < want && size < ((size_t)1 << 30)) size <<= 1;
+    size_t map_len = sizeof(ShmRing) + size;
+    ShmRing *r = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED) { perror("mmap ring"); return NULL; }
+    r->size = size;      // the mapping starts zeroed: empty, nobody waiting or closed
+    r->map_len = map_len;
+    return r;
+}
+
+static void shm_ring_free(ShmRing *r) {
+    if (r) munmap(r, r->map_len);
+}
+
+// Sleep on *seq until the other side bumps it, unless ready() already holds once
+// we've announced ourselves in *waiting
+static void shm_wait(ShmRing *r, uint32_t *seq, uint32_t *waiting, int (*ready)(ShmRing *)) {
+    uint32_t s = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+    __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+    if (!ready(r)) futex_wait(seq, s);
+    __atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+static void shm_notify(uint32_t *seq, uint32_t *waiting) {
+    __atomic_fetch_add(seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) futex_wake(seq);
+}
+
+static int shm_can_read(ShmRing *r) {
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail ||
+           __atomic_load_n(&r->writer_closed, __ATOMIC_ACQUIRE);
+}
+
+static int shm_can_write(ShmRing *r) {
+    return r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < r->size ||
+           __atomic_load_n(&r->reader_closed, __ATOMIC_ACQUIRE);
+}
+
+// like read(2): up to len bytes, 0 once the writer closed and the ring is drained
+static ssize_t shm_read(ShmRing *r, char *buf, size_t len) {
+    for (;;) {
+        uint64_t tail = r->tail;
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (head != tail) {
+            size_t n = head - tail < len ? (size_t)(head - tail) : len;
+            size_t off = (size_t)(tail & (r->size - 1));
+            size_t first = n < r->size - off ? n : r->size - off;
+            memcpy(buf, r->data + off, first);
+            memcpy(buf + first, r->data, n - first);
+            __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+            shm_notify(&r->space_seq, &r->writer_waiting);
+            return (ssize_t)n;
+        }
+        if (__atomic_load_n(&r->writer_closed, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail) continue; // wrote, then closed
+            return 0;
+        }
+        shm_wait(r, &r->data_seq, &r->reader_waiting, shm_can_read);
+    }
+}
+
+// like write_all(): -1 once the reader has gone away
+static int shm_write(ShmRing *r, const char *p, size_t len) {
+    while (len) {
+        if (__atomic_load_n(&r->reader_closed, __ATOMIC_ACQUIRE)) return -1;
+        uint64_t head = r->head;
+        size_t space = r->size - (size_t)(head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        if (space == 0) {
+            shm_wait(r, &r->space_seq, &r->writer_waiting, shm_can_write);
+            continue;
+        }
+        size_t n = len < space ? len : space;
+        size_t off = (size_t)(head & (r->size - 1));
+        size_t first = n < r->size - off ? n : r->size - off;
+        memcpy(r->data + off, p, first);
+        memcpy(r->data, p + first, n - first);
+        __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+        shm_notify(&r->data_seq, &r->reader_waiting);
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void shm_close_writer(ShmRing *r) {
+    __atomic_store_n(&r->writer_closed, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&r->data_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&r->data_seq);
+}
+
+static void shm_close_reader(ShmRing *r) {
+    __atomic_store_n(&r->reader_closed, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&r->space_seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&r->space_seq);
+}
+
+/* BUILTINS */
+
+// builtin= nodes are the small filters flows use most (wc, literal substitute,
+// head, tail, fixed-string grep). They run inside the interpreter over the pipe
+// data: on a thread where a pipe or target would fork the node, inline where the
+// node is run directly, so a fast filter never costs a fork+exec of a shell and a tool.
+
+#define BUILTIN_CHUNK (64 * 1024)
+
+// what a builtin reads from or writes to: a file descriptor, or one end of a ring
+typedef struct {
+    int fd;
+    ShmRing *ring;
+} Stream;
+
+static ssize_t read_some(const Stream *s, char *buf, size_t len) {
+    if (s->ring) return shm_read(s->ring, buf, len);
+    ssize_t r;
+    while ((r = read(s->fd, buf, len)) < 0 && errno == EINTR) {}
+    return r;
+}
+
+static int stream_write(const Stream *s, const char *p, size_t n) {
+    return s->ring ? shm_write(s->ring, p, n) : write_all(s->fd, p, n);
+}
+
+// collects small writes into BUILTIN_CHUNK-sized ones
+typedef struct {
+    const Stream *out;
+    int failed;
+    size_t len;
+    char buf[BUILTIN_CHUNK];
+} OutBuf;
+
+static void out_flush(OutBuf *o) {
+    if (o->len && !o->failed && stream_write(o->out, o->buf, o->len) < 0) o->failed = 1;
+    o->len = 0;
+}
+
+static void out_put(OutBuf *o, const char *p, size_t n) {
+    if (n >= sizeof o->buf) {
+        out_flush(o);
+        if (!o->failed && stream_write(o->out, p, n) < 0) o->failed = 1;
+        return;
+    }
+    if (o->len + n > sizeof o->buf) out_flush(o);
+    memcpy(o->buf + o->len, p, n);
+    o->len += n;
+}
+
+static size_t count_newlines(const char *p, size_t n) {
+    size_t count = 0, i = 0;
+#ifdef __SSE2__
+    // compare 16 bytes at a time and count the matches from the byte mask
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        count += (size_t)__builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+#endif
+    for (; i < n; i++) count += p[i] == '\n';
+    return count;
+}
+
+static int builtin_wc(const Node *n, const Stream *in, const Stream *out) {
+    static const unsigned char space[256] = { [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1 };
+    char buf[BUILTIN_CHUNK];
+    long long lines = 0, words = 0, bytes = 0;
+    int in_word = 0;
+    ssize_t r;
+    while ((r = read_some(in, buf, sizeof buf)) > 0) {
+        bytes += r;
+        if (n->builtin == BUILTIN_WC || n->builtin == BUILTIN_WC_L) lines += (long long)count_newlines(buf, (size_t)r);
+        if (n->builtin == BUILTIN_WC || n->builtin == BUILTIN_WC_W) {
+            for (ssize_t i = 0; i < r; i++) {
+                int sp = space[(unsigned char)buf[i]];
+                words += !sp && !in_word;
+                in_word = !sp;
+            }
+        }
+    }
+    if (r < 0) { perror("wc read"); return 1; }
+
+    // the same layout wc uses for stdin
+    char line[96];
+    int len;
+    if (n->builtin == BUILTIN_WC) len = snprintf(line, sizeof line, "%7lld %7lld %7lld\n", lines, words, bytes);
+    else len = snprintf(line, sizeof line, "%lld\n", n->builtin == BUILTIN_WC_L ? lines : n->builtin == BUILTIN_WC_W ? words : bytes);
+    return stream_write(out, line, (size_t)len) < 0 ? 1 : 0;
+}
+
+// Hand fn blocks of whole lines (the last one may lack its newline at EOF) until
+// the input ends or fn returns non-zero. Lines longer than the buffer grow it.
+static int for_each_lines(const Stream *in, int (*fn)(void *ctx, const char *p, size_t n), void *ctx) {
+    size_t cap = BUILTIN_CHUNK * 4, have = 0;
+    char *buf = malloc(cap);
+    if (!buf) { perror("malloc"); return -1; }
+
+    int rc = 0;
+    for (;;) {
+        if (have == cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) { perror("realloc"); rc = -1; break; }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t r = read_some(in, buf + have, cap - have);
+        if (r < 0) { perror("read"); rc = -1; break; }
+        if (r == 0) {
+            if (have) rc = fn(ctx, buf, have);
+            break;
+        }
+        size_t scanned = have;
+        have += (size_t)r;
+        char *last = memrchr(buf + scanned, '\n', have - scanned);
+        if (!last) continue;
+        size_t whole = (size_t)(last - buf) + 1;
+        if ((rc = fn(ctx, buf, whole)) != 0) break;
+        memmove(buf, buf + whole, have - whole);
+        have -= whole;
+    }
+    free(buf);
+    return rc < 0 ? -1 : 0;
+}
+
+typedef struct {
+    const Node *n;
+    OutBuf *out;
+    long left;      // head: lines still to pass
+    int matched;    // grep: any line matched
+} LineCtx;
+
+static int head_block(void *arg, const char *p, size_t n) {
+    LineCtx *c = arg;
+    const char *end = p + n, *q = p;
+    while (c->left > 0 && q < end) {
+        const char *nl = memchr(q, '\n', (size_t)(end - q));
+        q = nl ? nl + 1 : end;
+        c->left--;
+    }
+    out_put(c->out, p, (size_t)(q - p));
+    return c->left == 0 || c->out->failed;
+}
+
+static int sub_block(void *arg, const char *p, size_t n) {
+    LineCtx *c = arg;
+    const char *end = p + n;
+    size_t alen = strlen(c->n->pattern), blen = strlen(c->n->replacement);
+    const char *m;
+    while ((m = memmem(p, (size_t)(end - p), c->n->pattern, alen)) != NULL) {
+        out_put(c->out, p, (size_t)(m - p));
+        out_put(c->out, c->n->replacement, blen);
+        p = m + alen;
+    }
+    out_put(c->out, p, (size_t)(end - p));
+    return c->out->failed;
+}
+
+static int grep_block(void *arg, const char *p, size_t n) {
+    LineCtx *c = arg;
+    const char *end = p + n;
+    size_t plen = strlen(c->n->pattern);
+    const char *m;
+    // search the whole block at once and cut out the line around each match
+    while (p < end && (m = memmem(p, (size_t)(end - p), c->n->pattern, plen)) != NULL) {
+        const char *nl = memrchr(p, '\n', (size_t)(m - p));
+        const char *start = nl ? nl + 1 : p;
+        const char *stop = memchr(m, '\n', (size_t)(end - m));
+        stop = stop ? stop + 1 : end;
+        out_put(c->out, start, (size_t)(stop - start));
+        if (stop[-1] != '\n') out_put(c->out, "\n", 1);
+        c->matched = 1;
+        p = stop;
+    }
+    return c->out->failed;
+}
+
+// offset of the first of the last n lines in buf
+static size_t tail_start(const char *buf, size_t len, long n) {
+    size_t pos = len && buf[len - 1] == '\n' ? len - 1 : len;
+    if (n == 0) return len;
+    while (pos > 0) {
+        const char *nl = memrchr(buf, '\n', pos);
+        if (!nl) return 0;
+        if (--n == 0) return (size_t)(nl - buf) + 1;
+        pos = (size_t)(nl - buf);
+    }
+    return 0;
+}
+
+static int builtin_tail(const Node *n, const Stream *in, OutBuf *out) {
+    size_t cap = BUILTIN_CHUNK * 4, len = 0, trim_at = BUILTIN_CHUNK * 16;
+    char *buf = malloc(cap);
+    if (!buf) { perror("malloc"); return 1; }
+
+    ssize_t r;
+    for (;;) {
+        if (len == cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) { perror("realloc"); free(buf); return 1; }
+            buf = grown;
+            cap *= 2;
+        }
+        if ((r = read_some(in, buf + len, cap - len)) <= 0) break;
+        len += (size_t)r;
+
+        // only the last n lines so far can end up in the output; drop the rest now
+        // and then, doubling the threshold so the rescans stay linear overall
+        if (len >= trim_at) {
+            size_t keep = tail_start(buf, len, n->builtin_n);
+            memmove(buf, buf + keep, len - keep);
+            len -= keep;
+            if (trim_at < 2 * len) trim_at = 2 * len;
+        }
+    }
+    if (r < 0) perror("tail read");
+    size_t from = tail_start(buf, len, n->builtin_n);
+    out_put(out, buf + from, len - from);
+    free(buf);
+    return r < 0;
+}
+
+static int copy_file_to_fd(int in_fd, int out_fd);
+
+// source=: the kernel moves the file into out where it can, file to file with
+// copy_file_range and file to pipe with sendfile, so the data never comes up here
+static int builtin_source(const Node *n, const Stream *out) {
+    int fd = open(n->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { perror(n->path); return 1; }
+
+    int rc = 0;
+    if (out->ring) {
+        char buf[BUILTIN_CHUNK];
+        Stream in = { .fd = fd };
+        ssize_t r;
+        while (rc == 0 && (r = read_some(&in, buf, sizeof buf)) > 0) rc = shm_write(out->ring, buf, (size_t)r) < 0;
+        if (r < 0) rc = 1;
+    } else {
+        ssize_t m;
+        while ((m = copy_file_range(fd, NULL, out->fd, NULL, 1 << 30, 0)) > 0 || (m < 0 && errno == EINTR)) {}
+        if (m < 0 && errno != EXDEV && errno != EINVAL && errno != EBADF && errno != ENOSYS && errno != EOPNOTSUPP) rc = 1;
+        else if (m < 0) rc = copy_file_to_fd(fd, out->fd) < 0;  // picks up where the attempt stopped
+        if (rc && errno != EPIPE) perror(n->path);
+    }
+    close(fd);
+    return rc;
+}
+
+// sink=: splice moves pipe pages into the file; anything else is copied
+static int builtin_sink(const Node *n, const Stream *in) {
+    int fd = open(n->path, O_WRONLY | O_CREAT | O_CLOEXEC | (n->append ? O_APPEND : O_TRUNC), 0644);
+    if (fd < 0) { perror(n->path); return 1; }
+
+    int rc = 0;
+    if (in->ring) {
+        char buf[BUILTIN_CHUNK];
+        ssize_t r;
+        while (rc == 0 && (r = read_some(in, buf, sizeof buf)) > 0) rc = write_all(fd, buf, (size_t)r) < 0;
+        if (r < 0) rc = 1;
+    } else {
+        ssize_t m;
+        while ((m = splice(in->fd, NULL, fd, NULL, 1 << 30, SPLICE_F_MOVE)) > 0 || (m < 0 && errno == EINTR)) {}
+        if (m < 0 && errno == EINVAL) rc = copy_file_to_fd(in->fd, fd) < 0;  // not a pipe, or O_APPEND
+        else if (m < 0) rc = 1;
+    }
+    if (rc) perror(n->path);
+    if (close(fd) < 0) { perror(n->path); rc = 1; }
+    return rc;
+}
+
+// Run builtin node n from in to out. SIGPIPE stays blocked while it runs, so a
+// reader that went away is a failed write here rather than the end of the
+// interpreter.
+static int run_builtin_stream(const Node *n, const Stream *in, const Stream *out) {
+    sigset_t pipe_set, old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+
+    double start = trace_now_us();
+    OutBuf *o = malloc(sizeof *o);
+    if (!o) { perror("malloc"); pthread_sigmask(SIG_SETMASK, &old, NULL); return 1; }
+    o->out = out; o->failed = 0; o->len = 0;
+
+    LineCtx c = { .n = n, .out = o, .left = n->builtin_n };
+    int rc = 0;
+    switch (n->builtin) {
+    case BUILTIN_WC: case BUILTIN_WC_L: case BUILTIN_WC_W: case BUILTIN_WC_C:
+        rc = builtin_wc(n, in, out);
+        break;
+    case BUILTIN_HEAD:
+        if (c.left > 0) rc = for_each_lines(in, head_block, &c) < 0;
+        break;
+    case BUILTIN_TAIL:
+        rc = builtin_tail(n, in, o);
+        break;
+    case BUILTIN_SUB:
+        rc = for_each_lines(in, sub_block, &c) < 0;
+        break;
+    case BUILTIN_GREP:
+        rc = for_each_lines(in, grep_block, &c) < 0;
+        if (!rc && !c.matched) rc = 1; // like grep: nothing matched
+        break;
+    case BUILTIN_SOURCE:
+        rc = builtin_source(n, out);
+        break;
+    case BUILTIN_SINK:
+        rc = builtin_sink(n, in);
+        break;
+    }
+    out_flush(o);
+    if (o->failed) rc = 1;
+    free(o);
+
+    // drop a SIGPIPE our own writes raised before letting it through again
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&pipe_set, NULL, &zero) > 0) {}
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    char ecmd[2 * CMD_LEN], extra[2 * CMD_LEN + 64];
+    json_escape(ecmd, sizeof ecmd, n->command);
+    snprintf(extra, sizeof extra, "\"command\":\"%s\",\"exit\":%d", ecmd, rc);
+    trace_span("builtin", n->name, start, extra);
+    return rc;
+}
+
+static int run_builtin(const Node *n, int in, int out) {
+    Stream si = { .fd = in }, so = { .fd = out };
+    return run_builtin_stream(n, &si, &so);
+}
+
+// a builtin running beside the processes of a pipe; it closes the fds it was given,
+// and the ring ends, which take the place of in_fd and out_fd when set
+typedef struct {
+    const Node *n;
+    int in_fd, out_fd;
+    int close_in, close_out;
+    ShmRing *in_ring, *out_ring;
+    int status;
+    pthread_t tid;
+} BuiltinThread;
+
+// The pipe ends builtin threads own. A forked child doesn't get the threads, so it
+// closes these right after fork(); a child that doesn't exec would otherwise hold a
+// pipe end open and the other side would never see EOF or EPIPE.
+#define MAX_THREAD_FDS 16
+static pthread_mutex_t thread_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static int thread_fds[MAX_THREAD_FDS];
+static int thread_fd_count = 0;
+
+static void thread_fds_prepare(void) { pthread_mutex_lock(&thread_fds_lock); }
+static void thread_fds_parent(void) { pthread_mutex_unlock(&thread_fds_lock); }
+static void thread_fds_child(void) {
+    for (int i = 0; i < thread_fd_count; i++) close(thread_fds[i]);
+    thread_fd_count = 0;
+    pthread_mutex_unlock(&thread_fds_lock);
+}
+
+static void thread_fds_init(void) {
+    pthread_atfork(thread_fds_prepare, thread_fds_parent, thread_fds_child);
+}
+
+static void hold_thread_fd(int fd) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, thread_fds_init);
+    pthread_mutex_lock(&thread_fds_lock);
+    if (thread_fd_count < MAX_THREAD_FDS) thread_fds[thread_fd_count++] = fd;
+    pthread_mutex_unlock(&thread_fds_lock);
+}
+
+// forget and close fd under the lock, so no fork sees it half-released
+static void release_thread_fd(int fd) {
+    pthread_mutex_lock(&thread_fds_lock);
+    for (int i = 0; i < thread_fd_count; i++) {
+        if (thread_fds[i] == fd) { thread_fds[i] = thread_fds[--thread_fd_count]; break; }
+    }
+    close(fd);
+    pthread_mutex_unlock(&thread_fds_lock);
+}
+
+static void *builtin_thread_main(void *arg) {
+    BuiltinThread *bt = arg;
+    Stream in = { bt->in_fd, bt->in_ring }, out = { bt->out_fd, bt->out_ring };
+    bt->status = run_builtin_stream(bt->n, &in, &out);
+    if (bt->in_ring) shm_close_reader(bt->in_ring);
+    if (bt->out_ring) shm_close_writer(bt->out_ring);
+    if (bt->close_in) release_thread_fd(bt->in_fd);
+    if (bt->close_out) release_thread_fd(bt->out_fd);
+    return NULL;
+}
+
+static int start_builtin_thread(BuiltinThread *bt) {
+    if (bt->close_in) hold_thread_fd(bt->in_fd);
+    if (bt->close_out) hold_thread_fd(bt->out_fd);
+    int err = pthread_create(&bt->tid, NULL, builtin_thread_main, bt);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        if (bt->in_ring) shm_close_reader(bt->in_ring);
+        if (bt->out_ring) shm_close_writer(bt->out_ring);
+        if (bt->close_in) release_thread_fd(bt->in_fd);
+        if (bt->close_out) release_thread_fd(bt->out_fd);
+        bt->status = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/* PROCESS CREATOR / EXECUTOR */
+
+static int run_component_into_fd(const char *name, int out_fd);
+static uint64_t subgraph_sig(int idx);
+
+// Turn the calling child into node n (a builtin just runs in it): apply its cpus=, nice= and memory= limits,
+// then exec its command. Never returns. With timeout= the child stays behind as a
+// supervisor: the command runs in its own process group, and the whole group is
+// killed if it outlives the timeout (exit status 124, like timeout(1)).
+static void exec_node(const Node *n) {
+    if (n->builtin) _exit(run_builtin(n, STDIN_FILENO, STDOUT_FILENO));
+
+    if (n->has_cpus && sched_setaffinity(0, sizeof n->cpus, &n->cpus) < 0) {
+        fprintf(stderr, "node '%s': sched_setaffinity: %s\n", n->name, strerror(errno));
+    }
+    if (n->nice) {
+        errno = 0;
+        if (nice(n->nice) == -1 && errno) fprintf(stderr, "node '%s': nice: %s\n", n->name, strerror(errno));
+    }
+    if (n->memory) {
+        struct rlimit rl = { .rlim_cur = n->memory, .rlim_max = n->memory };
+        if (setrlimit(RLIMIT_AS, &rl) < 0) fprintf(stderr, "node '%s': setrlimit: %s\n", n->name, strerror(errno));
+    }
+
+    if (n->timeout > 0) {
+        sigset_t set, old;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGHUP);
+        sigprocmask(SIG_BLOCK, &set, &old);
+
+        pid_t c = fork();
+        if (c < 0) { perror("fork supervised node"); _exit(127); }
+        if (c == 0) {
+            setpgid(0, 0);
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            execlp("sh", "sh", "-c", n->command, (char*)0);
+            perror("exec node");
+            _exit(127);
+        }
+        setpgid(c, c); // also here, so the group exists before any kill below
+
+        struct timespec left = { (time_t)n->timeout, (long)((n->timeout - (time_t)n->timeout) * 1e9) };
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        int timed_out = 0;
+        for (;;) {
+            int sig = sigtimedwait(&set, NULL, &left);
+            if (sig == SIGCHLD) {
+                int st;
+                if (waitpid(c, &st, WNOHANG) == c) {
+                    if (timed_out) _exit(124);
+                    _exit(WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st));
+                }
+            } else if (sig > 0) {
+                kill(-c, sig); // pass interrupts on, since the group is off the terminal's
+            } else if (errno == EAGAIN && !timed_out) {
+                fprintf(stderr, "node '%s' timed out after %gs\n", n->name, n->timeout);
+                kill(-c, SIGKILL);
+                timed_out = 1;
+                left.tv_sec = 1000000; left.tv_nsec = 0;
+                continue;
+            }
+
+            // sigtimedwait doesn't report time left, so work it out again
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double spent = (double)(now.tv_sec - begin.tv_sec) + (double)(now.tv_nsec - begin.tv_nsec) / 1e9;
+            double rest = timed_out ? 1e6 : n->timeout - spent;
+            if (rest < 0) rest = 0;
+            left.tv_sec = (time_t)rest;
+            left.tv_nsec = (long)((rest - (double)left.tv_sec) * 1e9);
+        }
+    }
+
+    execlp("sh", "sh", "-c", n->command, (char*)0);
+    fprintf(stderr, "exec node '%s': %s\n", n->name, strerror(errno));
+    _exit(127);
+}
+
+int run_pipe(const char *leftCmd, const char *rightCmd) {
+    // fd[0] - read end of the pipe
+    // fd[1] - write end of the pipe
+    int fd[2];
+
+    if (pipe(fd) <  0) { 
+        perror("error on pipe"); 
+        return -1; 
+    }
+
+    pid_t c1 = fork();
+
+    // if it's the child process, make this one the producer
+    if (c1 == -1) { 
+        perror("error on c1 fork"); 
+        close(fd[0]); 
+        close(fd[1]); 
+        return -1; 
+    }
+
+    if (c1 == 0) {
+        // redirect the stdout of this process into the write end of the pipe
+        dup2(fd[1], STDOUT_FILENO);
+        close(fd[0]); // don't need read end
+        close(fd[1]); // close original write end
+
+        // run as shell- lets us not have to write a parser for this
+        execlp("sh", "sh", "-c", leftCmd, (char*)0);
+        perror("error executing left command");
+        _exit(127);
+    }
+
+    pid_t c2 = fork();
+
+    if (c2 == -1) { 
+        perror("error on c2 fork"); 
+        close(fd[0]); 
+        close(fd[1]); 
+        return -1; 
+    }
+    
+    // and this one the consumer
+    if (c2 == 0) {
+        // redirect the stdin of this process into the read end of the pipe
+        // i.e., this will read from the pipe
+        dup2(fd[0], STDIN_FILENO);
+        close(fd[1]); // ditto above
+        close(fd[0]);
+        execlp("sh", "sh", "-c", rightCmd, (char*)0);
+        perror("error executing right command");
+        _exit(127);
+    }
+
+    close(fd[0]);
+    close(fd[1]);
+
+    int status;
+
+    waitpid(c1, NULL, 0);
+    waitpid(c2, &status, 0);
+
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+
+    return -1;
+}
+
+/* RESULT CACHE */
+
+// fold a file's name and contents into h; a missing file hashes differently from an empty one
+static uint64_t hash_file(uint64_t h, const char *path) {
+    h = fnv1a(h, path, strlen(path) + 1);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb) < 0) {
+        if (fd >= 0) close(fd);
+        return fnv1a(h, "\0missing", 8);
+    }
+    if (sb.st_size > 0) {
+        void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            h = fnv1a(h, map, (size_t)sb.st_size);
+            munmap(map, (size_t)sb.st_size);
+        }
+    }
+    close(fd);
+    return h;
+}
+
+// cache key: the command text plus the contents of every declared input
+static uint64_t node_cache_key(const Node *n) {
+    uint64_t h = fnv1a(0xcbf29ce484222325ULL, n->command, strlen(n->command) + 1);
+    char inputs[CMD_LEN];
+    strcpy(inputs, n->inputs);
+    char *save = NULL;
+    for (char *path = strtok_r(inputs, " \t", &save); path; path = strtok_r(NULL, " \t", &save)) {
+        h = hash_file(h, path);
+    }
+    return h;
+}
+
+static const char *cache_dir(void) {
+    const char *dir = getenv("FLOW_CACHE_DIR");
+    return (dir && dir[0]) ? dir : CACHE_DIR;
+}
+
+// Stream a whole file into out_fd. sendfile() keeps the copy in the kernel; it
+// refuses some destinations (e.g. O_APPEND files), which fall back to read/write.
+static int copy_file_to_fd(int in_fd, int out_fd) {
+    for (;;) {
+        ssize_t m = sendfile(out_fd, in_fd, NULL, 1 << 30);
+        if (m > 0) continue;
+        if (m == 0) return 0;
+        if (errno == EINTR) continue;
+        if (errno == EINVAL || errno == ENOSYS) break;
+        return -1;
+    }
+    char buf[TEE_CHUNK];
+    for (;;) {
+        ssize_t r = read(in_fd, buf, sizeof buf);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) return 0;
+        if (write_all(out_fd, buf, (size_t)r) < 0) return -1;
+    }
+}
+
+static int run_node_uncached(const Node *n, int out_fd);
+
+// Serve a cacheable node: a hit streams the stored output without forking; a miss
+// runs the node into a temp file in the cache, keeps it if the node succeeded, and
+// then streams it on
+static int run_cached_node_into_fd(const Node *n, int out_fd) {
+    double start = trace_now_us();
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/%016llx", cache_dir(), (unsigned long long)node_cache_key(n));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        int rc = copy_file_to_fd(fd, out_fd);
+        close(fd);
+        if (rc < 0) perror("cache read");
+        trace_span("cache", n->name, start, "\"hit\":1");
+        return rc < 0 ? -1 : 0;
+    }
+
+    mkdir(cache_dir(), 0755);
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof tmp, "%s/tmp.XXXXXX", cache_dir());
+    int tfd = mkostemp(tmp, O_CLOEXEC);
+    if (tfd < 0) {
+        // no usable cache directory; just run the node
+        return run_node_uncached(n, out_fd);
+    }
+
+    int rc = run_node_uncached(n, tfd);
+    if (rc == 0 && rename(tmp, path) < 0) perror("cache store");
+    if (rc != 0) unlink(tmp);
+
+    // the output goes downstream either way, like an uncached run
+    lseek(tfd, 0, SEEK_SET);
+    if (copy_file_to_fd(tfd, out_fd) < 0) {
+        perror("cache read");
+        if (rc == 0) rc = -1;
+    }
+    close(tfd);
+    trace_span("cache", n->name, start, "\"hit\":0");
+    return rc;
+}
+
+// Run a node so that its STDOUT goes to out_fd, from the cache if it is cacheable
+static int run_node_into_fd(const Node *n, int out_fd) {
+    if (n->cacheable) return run_cached_node_into_fd(n, out_fd);
+    return run_node_uncached(n, out_fd);
+}
+
+// Fork and exec a node with its STDOUT on out_fd
+static int run_node_uncached(const Node *n, int out_fd) {
+    if (n->builtin) return run_builtin(n, STDIN_FILENO, out_fd);
+
+    double start = trace_now_us();
+    pid_t c = fork();
+    if (c == 0) {
+        if (dup2(out_fd, STDOUT_FILENO) < 0) { 
+            perror("dup2"); 
+            _exit(127); 
+        }
+        exec_node(n);
+    }
+    int st = wait_traced(c, n->name, n->command, start);
+    return (WIFEXITED(st)? WEXITSTATUS(st) : -1);
+}
+
+// Run STDERR of a node into out_fd (and silence its normal stdout)
+static int run_stderr_into_fd(const Stderr *sd, int out_fd) {
+    const Node *n = get_node_by_name(node_array, node_count, sd->from_node);
+    if (!n) { 
+        fprintf(stderr,"stderr from unknown node '%s'\n", sd->from_node); 
+        return -1; 
+    }
+
+    double start = trace_now_us();
+    pid_t c = fork();
+    if (c == 0) {
+        // redirect this child's STDERR to out_fd
+        if (dup2(out_fd, STDERR_FILENO) < 0) {
+             perror("dup2 err"); 
+             _exit(127); 
+        }
+
+        // silence its STDOUT so it doesn't mix with errors
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) {
+            dup2(devnull, STDOUT_FILENO);
+            close(devnull);
+        }
+
+        exec_node(n);
+    }
+    int st = wait_traced(c, sd->name, n->command, start);
+    return (WIFEXITED(st)? WEXITSTATUS(st) : -1);
+}
+
+// Run a node once and hand its stdout and stderr to separate consumer nodes,
+// both of which write into out_fd. Each stream has its own pipe straight into
+// its consumer, so a consumer that falls behind only ever holds up its own stream.
+static int run_streams_into_fd(const Streams *st, int out_fd) {
+    const Node *n = get_node_by_name(node_array, node_count, st->from);
+    const Node *out = st->out[0] ? get_node_by_name(node_array, node_count, st->out) : NULL;
+    const Node *err = st->err[0] ? get_node_by_name(node_array, node_count, st->err) : NULL;
+    if (!n || (st->out[0] && !out) || (st->err[0] && !err)) {
+        fprintf(stderr, "bad streams endpoints\n");
+        return -1;
+    }
+
+    int o[2] = { -1, -1 }, e[2] = { -1, -1 };
+    if ((out && open_pipe(o, 0) < 0) || (err && open_pipe(e, 0) < 0)) {
+        perror("pipe");
+        if (o[0] >= 0) { close(o[0]); close(o[1]); }
+        return -1;
+    }
+
+    double start = trace_now_us();
+    const Node *consumer[2] = { out, err };
+    int *ends[2] = { o, e };
+    pid_t kids[2] = { 0, 0 };
+    for (int i = 0; i < 2; i++) {
+        if (!consumer[i]) continue;
+        kids[i] = fork();
+        if (kids[i] < 0) { perror("fork streams consumer"); continue; }
+        if (kids[i] == 0) {
+            dup2(ends[i][0], STDIN_FILENO);
+            if (dup2(out_fd, STDOUT_FILENO) < 0) { perror("dup2 out"); _exit(127); }
+            for (int j = 0; j < 2; j++) if (ends[j][0] >= 0) { close(ends[j][0]); close(ends[j][1]); }
+            exec_node(consumer[i]);
+        }
+    }
+
+    pid_t producer = fork();
+    if (producer == 0) {
+        if (dup2(out ? o[1] : out_fd, STDOUT_FILENO) < 0) { perror("dup2 out"); _exit(127); }
+        if (err) dup2(e[1], STDERR_FILENO);
+        for (int j = 0; j < 2; j++) if (ends[j][0] >= 0) { close(ends[j][0]); close(ends[j][1]); }
+        exec_node(n);
+    }
+    if (producer < 0) perror("fork streams producer");
+
+    for (int j = 0; j < 2; j++) if (ends[j][0] >= 0) { close(ends[j][0]); close(ends[j][1]); }
+
+    int result = -1;
+    if (producer > 0) {
+        int ps = wait_traced(producer, n->name, n->command, start);
+        result = WIFEXITED(ps) ? WEXITSTATUS(ps) : -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (kids[i] <= 0) { if (consumer[i] && result == 0) result = -1; continue; }
+        int cs = wait_traced(kids[i], consumer[i]->name, consumer[i]->command, start);
+        int rc = WIFEXITED(cs) ? WEXITSTATUS(cs) : -1;
+        if (result == 0) result = rc;
+    }
+    trace_span("streams", st->name, start, NULL);
+    return result;
+}
+
+// Put a user-space ring buffer of size bytes in front of *read_fd: a relay process
+// drains the pipe into the ring as fast as the producer fills it and feeds the
+// consumer from the ring, so a bursty producer can run ahead by up to size bytes
+// without holding that much in the kernel. *read_fd is replaced by the read end the
+// consumer should use. The relay closes the other_fds it inherited, so every end it
+// doesn't use still sees EOF/EPIPE on time.
+static pid_t ring_relay(const char *label, size_t size, int *read_fd, const int other_fds[], int n_other) {
+    int r[2];
+    if (open_pipe(r, 0) < 0) { perror("pipe"); return 0; }
+
+    double start = trace_now_us();
+    pid_t c = fork();
+    if (c < 0) { perror("fork ring"); close(r[0]); close(r[1]); return 0; }
+    if (c == 0) {
+        signal(SIGPIPE, SIG_IGN); // a consumer that quits early just ends the relay
+        close(r[0]);
+        for (int i = 0; i < n_other; i++) if (other_fds[i] != *read_fd) close(other_fds[i]);
+
+        char *ring = malloc(size);
+        if (!ring) { perror("malloc ring"); _exit(1); }
+        int in = *read_fd, out = r[1];
+        fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+        fcntl(out, F_SETFL, fcntl(out, F_GETFL) | O_NONBLOCK);
+
+        size_t head = 0, used = 0, peak = 0;   // data is ring[head .. head+used), wrapping
+        long long bytes = 0;
+        int eof = 0;
+        while (!eof || used > 0) {
+            struct pollfd pfd[2] = {
+                { .fd = (!eof && used < size) ? in : -1, .events = POLLIN },
+                { .fd = used > 0 ? out : -1, .events = POLLOUT },
+            };
+            if (poll(pfd, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+
+            if (pfd[0].revents) {
+                size_t tail = (head + used) % size;
+                size_t room = tail >= head && used < size ? size - tail : head - tail;
+                ssize_t m = read(in, ring + tail, room);
+                if (m > 0) { used += (size_t)m; bytes += m; if (used > peak) peak = used; }
+                else if (m == 0 || (errno != EAGAIN && errno != EINTR)) eof = 1;
+            }
+            if (pfd[1].revents & (POLLERR | POLLHUP)) break; // consumer went away
+            if (pfd[1].revents) {
+                size_t span = head + used <= size ? used : size - head;
+                ssize_t m = write(out, ring + head, span);
+                if (m > 0) { head = (head + (size_t)m) % size; used -= (size_t)m; }
+                else if (m < 0 && errno != EAGAIN && errno != EINTR) break;
+            }
+        }
+
+        char extra[96];
+        snprintf(extra, sizeof extra, "\"bytes\":%lld,\"ring\":%zu,\"peak\":%zu", bytes, size, peak);
+        trace_span("ring", label, start, extra);
+        _exit(0);
+    }
+    close(r[1]);
+    *read_fd = r[0];
+    return c;
+}
+
+/* CHECKPOINTS */
+
+// A pipe with checkpoint=1 spools what its producer writes to
+// .flow-ckpt/<pipe>.ckpt while passing it on to the consumer. The spool is kept
+// only if the producer finished cleanly. When a later part of the run fails, the
+// next run replays the spool into the consumer instead of running everything
+// upstream again. Spools are removed once a run succeeds. Format:
+//   "FLOWCKP1" u64 signature, then records [u32 len][u32 hash][len bytes],
+//   then a trailer [u32 0][u32 producer status]
+// The signature is that of the producer's subgraph (see subgraph_sig), so a
+// changed command or input file invalidates the spool. Each record is checked
+// against its hash before anything is replayed.
+
+#define CKPT_DIR ".flow-ckpt"
+#define CKPT_MAGIC "FLOWCKP1"
+#define CKPT_CHUNK (256 * 1024)
+
+static uint32_t ckpt_hash(const void *data, size_t len) {
+    uint64_t h = fnv1a(0xcbf29ce484222325ULL, data, len);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static void ckpt_path(char *out, size_t cap, const Pipe *p, int tmp) {
+    char name[MAX_NAME_LEN];
+    strcpy(name, p->name);
+    for (char *c = name; *c; c++) if (*c == '/') *c = '_';
+    snprintf(out, cap, "%s/%s.ckpt%s", CKPT_DIR, name, tmp ? ".tmp" : "");
+}
+
+static uint64_t ckpt_sig(const Pipe *p) {
+    return subgraph_sig((int)(lookup(p->from) - symbols));
+}
+
+// Map a complete, intact checkpoint for p; NULL if there isn't one
+static const char *ckpt_map(const Pipe *p, size_t *len) {
+    char path[PATH_MAX];
+    ckpt_path(path, sizeof path, p, 0);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    const char *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= 16 + 8) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) map = NULL;
+    }
+    close(fd);
+    if (!map) return NULL;
+    *len = (size_t)st.st_size;
+
+    uint64_t sig = ckpt_sig(p);
+    int ok = memcmp(map, CKPT_MAGIC, 8) == 0 && memcmp(map + 8, &sig, 8) == 0;
+    size_t off = 16;
+    while (ok) {
+        uint32_t hdr[2];
+        if (off + sizeof hdr > *len) { ok = 0; break; }
+        memcpy(hdr, map + off, sizeof hdr);
+        off += sizeof hdr;
+        if (hdr[0] == 0) { ok = hdr[1] == 0 && off == *len; break; }
+        if (off + hdr[0] > *len || ckpt_hash(map + off, hdr[0]) != hdr[1]) { ok = 0; break; }
+        off += hdr[0];
+    }
+    if (!ok) {
+        fprintf(stderr, "checkpoint for '%s' is stale or damaged; running it again\n", p->name);
+        munmap((void *)map, *len);
+        unlink(path);
+        return NULL;
+    }
+    return map;
+}
+
+// write the data of a checkpoint that ckpt_map() accepted
+static int ckpt_replay(const Pipe *p, const char *map, size_t len, int out_fd) {
+    double start = trace_now_us();
+    long long bytes = 0;
+    int rc = 0;
+    for (size_t off = 16; off + 8 <= len; ) {
+        uint32_t hdr[2];
+        memcpy(hdr, map + off, sizeof hdr);
+        off += sizeof hdr;
+        if (hdr[0] == 0) break;
+        if (write_all(out_fd, map + off, hdr[0]) < 0) { rc = 1; break; }
+        off += hdr[0];
+        bytes += hdr[0];
+    }
+    char extra[64];
+    snprintf(extra, sizeof extra, "\"bytes\":%lld", bytes);
+    trace_span("resume", p->name, start, extra);
+    return rc;
+}
+
+// Put a spooling relay in front of *write_fd, like trace_relay(). It exits 0 only
+// if it saw the producer's EOF and spooled everything.
+static pid_t ckpt_relay(const Pipe *p, int *write_fd, int reader_fd) {
+    char path[PATH_MAX];
+    ckpt_path(path, sizeof path, p, 1);
+    if (mkdir(CKPT_DIR, 0755) < 0 && errno != EEXIST) { perror(CKPT_DIR); return 0; }
+    int spool = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (spool < 0) { perror(path); return 0; }
+
+    uint64_t sig = ckpt_sig(p);
+    int r[2];
+    if (open_pipe(r, 0) < 0) { perror("pipe"); close(spool); return 0; }
+
+    double start = trace_now_us();
+    pid_t c = fork();
+    if (c < 0) { perror("fork checkpoint"); close(r[0]); close(r[1]); close(spool); return 0; }
+    if (c == 0) {
+        signal(SIGPIPE, SIG_IGN);
+        close(r[1]);
+        if (reader_fd >= 0) close(reader_fd);
+
+        char *buf = malloc(CKPT_CHUNK);
+        int failed = !buf || write_all(spool, CKPT_MAGIC, 8) < 0 || write_all(spool, (const char *)&sig, 8) < 0;
+        long long bytes = 0;
+        while (!failed) {
+            ssize_t m = read(r[0], buf, CKPT_CHUNK);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0) { failed = 1; break; }
+            if (m == 0) break;
+
+            uint32_t hdr[2] = { (uint32_t)m, ckpt_hash(buf, (size_t)m) };
+            struct iovec iov[2] = { { hdr, sizeof hdr }, { buf, (size_t)m } };
+            ssize_t w = writev(spool, iov, 2);
+            if (w != (ssize_t)(sizeof hdr) + m) failed = 1;   // disk full: stop spooling, keep streaming
+            if (write_all(*write_fd, buf, (size_t)m) < 0) { failed = 1; break; }
+            bytes += m;
+        }
+        char extra[64];
+        snprintf(extra, sizeof extra, "\"bytes\":%lld", bytes);
+        trace_span("checkpoint", p->name, start, extra);
+        _exit(failed);
+    }
+    close(r[0]);
+    close(spool);
+    *write_fd = r[1];
+    return c;
+}
+
+// Seal the spool if the relay and the producer both finished cleanly; drop it otherwise
+static void ckpt_finish(const Pipe *p, pid_t relay, int producer_status) {
+    int st = 0;
+    while (waitpid(relay, &st, 0) < 0 && errno == EINTR) {}
+
+    char tmp[PATH_MAX], path[PATH_MAX];
+    ckpt_path(tmp, sizeof tmp, p, 1);
+    ckpt_path(path, sizeof path, p, 0);
+    if (!WIFEXITED(st) || WEXITSTATUS(st) != 0 || producer_status != 0) {
+        unlink(tmp);
+        return;
+    }
+
+    uint32_t trailer[2] = { 0, (uint32_t)producer_status };
+    int fd = open(tmp, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0 || write_all(fd, (const char *)trailer, sizeof trailer) < 0 || rename(tmp, path) < 0) {
+        perror("checkpoint");
+        unlink(tmp);
+    }
+    if (fd >= 0) close(fd);
+}
+
+// after a successful run nothing needs resuming
+static void ckpt_clear(void) {
+    for (int i = 0; i < pipe_count; i++) {
+        if (!pipe_array[i].checkpoint) continue;
+        char path[PATH_MAX];
+        ckpt_path(path, sizeof path, &pipe_array[i], 0);
+        unlink(path);
+    }
+    rmdir(CKPT_DIR); // only goes if nothing else is in there
+}
+
+// transport=shm: a run of shm pipes whose consumers are builtins, each pipe the
+// from= of the next, runs as one chain of builtin threads joined by rings. Only
+// the ends of the chain touch file descriptors: the first stage reads our stdin
+// when the source is a builtin too, or else a kernel pipe from the forked source,
+// and the last stage writes out_fd.
+
+#define MAX_SHM_STAGES 16
+
+typedef struct {
+    const Node *stage[MAX_SHM_STAGES];
+    const Pipe *link[MAX_SHM_STAGES];   // link[i] feeds stage[i]; NULL for a builtin source
+    int count;
+    const char *source;                 // component feeding stage[0], or NULL if it is a builtin
+} ShmChain;
+
+static int shm_stage(const Node *n) {
+    return n && n->builtin && !n->cacheable;
+}
+
+// the chain ending in p; 0 if fewer than two builtins would share a ring
+static int shm_chain(const Pipe *p, ShmChain *c) {
+    const Node *stage[MAX_SHM_STAGES];
+    const Pipe *link[MAX_SHM_STAGES];
+    int n = 0;
+    const char *source = NULL;
+    for (const Pipe *cur = p; cur && n < MAX_SHM_STAGES - 1; cur = get_pipe_by_name(pipe_array, pipe_count, source)) {
+        const Node *to = get_node_by_name(node_array, node_count, cur->to);
+        if (!cur->shm || cur->ring || cur->checkpoint || !shm_stage(to)) break;
+        link[n] = cur;
+        stage[n++] = to;
+        source = cur->from;
+    }
+    if (n == 0) return 0;
+
+    const Node *first = get_node_by_name(node_array, node_count, source);
+    if (shm_stage(first)) {
+        link[n] = NULL;
+        stage[n++] = first;
+        source = NULL;
+    }
+    if (n < 2) return 0;
+
+    // the walk went downstream to upstream
+    for (int i = 0; i < n; i++) {
+        c->stage[i] = stage[n - 1 - i];
+        c->link[i] = link[n - 1 - i];
+    }
+    c->count = n;
+    c->source = source;
+    return n;
+}
+
+static int run_shm_chain(const ShmChain *c, int out_fd) {
+    ShmRing *rings[MAX_SHM_STAGES] = { 0 };
+    for (int i = 1; i < c->count; i++) {
+        const Pipe *l = c->link[i];
+        if (!(rings[i] = shm_ring_open(l->buffer ? l->buffer : SHM_RING_SIZE))) {
+            for (int j = 1; j < i; j++) shm_ring_free(rings[j]);
+            return -1;
+        }
+    }
+
+    // a source that isn't a builtin runs as the producer of a plain pipe does
+    double start = trace_now_us();
+    int in_fd = STDIN_FILENO;
+    pid_t src = 0;
+    const Node *from = c->source ? get_node_by_name(node_array, node_count, c->source) : NULL;
+    if (c->source) {
+        int fd[2];
+        if (open_pipe(fd, c->link[0]->buffer) < 0) {
+            perror("pipe");
+            for (int i = 1; i < c->count; i++) shm_ring_free(rings[i]);
+            return -1;
+        }
+        src = fork();
+        if (src == 0) {
+            dup2(fd[1], STDOUT_FILENO);
+            close(fd[0]); close(fd[1]);
+            if (!from || from->cacheable) { int rc = run_component_into_fd(c->source, STDOUT_FILENO); _exit(rc < 0 ? 1 : rc); }
+            exec_node(from);
+        }
+        close(fd[1]);
+        in_fd = fd[0];
+    }
+
+    BuiltinThread bt[MAX_SHM_STAGES];
+    for (int i = 0; i < c->count; i++) {
+        int last = i == c->count - 1;
+        bt[i] = (BuiltinThread){
+            .n = c->stage[i],
+            .in_fd = i ? -1 : in_fd,
+            .close_in = i == 0 && src > 0,
+            .in_ring = rings[i],
+            .out_fd = last ? out_fd : -1,
+            .out_ring = last ? NULL : rings[i + 1],
+        };
+    }
+    int started[MAX_SHM_STAGES];
+    for (int i = 0; i < c->count; i++) started[i] = start_builtin_thread(&bt[i]) == 0;
+
+    if (src > 0) wait_traced(src, c->source, from ? from->command : NULL, start);
+    for (int i = 0; i < c->count; i++) if (started[i]) pthread_join(bt[i].tid, NULL);
+
+    for (int i = 1; i < c->count; i++) {
+        char extra[64];
+        snprintf(extra, sizeof extra, "\"bytes\":%llu", (unsigned long long)rings[i]->head);
+        trace_span("shm", c->link[i]->name, start, extra);
+        shm_ring_free(rings[i]);
+    }
+    return bt[c->count - 1].status;
+}
+
+// Run a pipe and send the RIGHT side's STDOUT into out_fd
+static int run_pipe_into_fd(const Pipe *p, int out_fd) {
+    ShmChain chain;
+    if (p->shm && shm_chain(p, &chain)) return run_shm_chain(&chain, out_fd);
+
+    // set up the inner ls|wc, but make wc's stdout go to out_fd
+    int fd[2]; if (open_pipe(fd, p->buffer) < 0) { 
+        perror("pipe"); 
+        return -1; 
+    }
+
+    // the producer can be any component; the consumer reads stdin so must be a node
+    const Node *from = get_node_by_name(node_array, node_count, p->from);
+    const Node *to = get_node_by_name(node_array, node_count, p->to);
+
+    if (!lookup(p->from) || !to) { 
+        fprintf(stderr,"bad pipe endpoints\n"); 
+        close(fd[0]); 
+        close(fd[1]); 
+        return -1; 
+    }
+
+    // with checkpoint=1 a sealed spool from an earlier run stands in for the
+    // producer; otherwise the producer writes through a relay that spools it
+    size_t ckpt_len = 0;
+    const char *ckpt = p->checkpoint ? ckpt_map(p, &ckpt_len) : NULL;
+    int prod_fd = fd[1];
+    pid_t spool = 0;
+    if (p->checkpoint && !ckpt) spool = ckpt_relay(p, &prod_fd, fd[0]);
+    int mid_fd = prod_fd;
+    if (ckpt) fprintf(stderr, "resuming '%s' from its checkpoint\n", p->name);
+
+    // with tracing on, the producer writes through a relay that counts the bytes
+    pid_t relay = trace_relay(p->name, &prod_fd, fd[0]);
+
+    // and with ring= the consumer reads through a user-space ring
+    int cons_fd = fd[0];
+    pid_t ring = 0;
+    if (p->ring) {
+        int others[] = { fd[1], prod_fd, mid_fd };
+        ring = ring_relay(p->name, p->ring, &cons_fd, others, 3);
+    }
+
+    // builtin ends run on threads here instead of in forked children
+    int from_thread = from && from->builtin && !from->cacheable && !ckpt;
+    int to_thread = to->builtin;
+
+    double start = trace_now_us();
+    pid_t c1 = 0, c2 = 0;
+    if (!from_thread) c1 = fork();
+    if (c1 == 0 && !from_thread) { // producer
+        dup2(prod_fd, STDOUT_FILENO);
+        close(fd[0]); close(fd[1]);
+        if (prod_fd != fd[1]) close(prod_fd);
+        if (mid_fd != fd[1] && mid_fd != prod_fd) close(mid_fd);
+        if (cons_fd != fd[0]) close(cons_fd);
+        if (ckpt) _exit(ckpt_replay(p, ckpt, ckpt_len, STDOUT_FILENO));
+        if (!from || from->cacheable) { int rc = run_component_into_fd(p->from, STDOUT_FILENO); _exit(rc < 0 ? 1 : rc); }
+        exec_node(from);
+    }
+
+    if (!to_thread) c2 = fork();
+    if (c2 == 0 && !to_thread) { // consumer
+        dup2(cons_fd, STDIN_FILENO);
+        close(fd[1]); close(fd[0]);
+        if (prod_fd != fd[1]) close(prod_fd); // else the relay never sees EOF
+        if (mid_fd != fd[1] && mid_fd != prod_fd) close(mid_fd);
+        if (cons_fd != fd[0]) close(cons_fd);
+        // redirect consumer's stdout to out_fd
+        if (dup2(out_fd, STDOUT_FILENO) < 0) { perror("dup2 out"); _exit(127); }
+        exec_node(to);
+    }
+
+    // each thread gets its own copy of its end, so the parent can close the rest as usual
+    BuiltinThread producer = { .n = from, .in_fd = STDIN_FILENO, .close_out = 1 };
+    BuiltinThread consumer = { .n = to, .out_fd = out_fd, .close_in = 1 };
+    if (from_thread) producer.out_fd = fcntl(prod_fd, F_DUPFD_CLOEXEC, 0);
+    if (to_thread) consumer.in_fd = fcntl(cons_fd, F_DUPFD_CLOEXEC, 0);
+
+    close(fd[0]); close(fd[1]);
+    if (prod_fd != fd[1]) close(prod_fd);
+    if (mid_fd != fd[1] && mid_fd != prod_fd) close(mid_fd);
+    if (cons_fd != fd[0]) close(cons_fd);
+
+    int from_ok = from_thread && start_builtin_thread(&producer) == 0;
+    int to_ok = to_thread && start_builtin_thread(&consumer) == 0;
+
+    int prod_status = producer.status;
+    if (c1 > 0) {
+        int ps = wait_traced(c1, p->from, ckpt ? "checkpoint" : from ? from->command : NULL, start);
+        prod_status = WIFEXITED(ps) ? WEXITSTATUS(ps) : -1;
+    }
+    if (from_ok) { pthread_join(producer.tid, NULL); prod_status = producer.status; }
+    int rc = consumer.status;
+    if (c2 > 0) {
+        int st = wait_traced(c2, to->name, to->command, start);
+        rc = WIFEXITED(st)? WEXITSTATUS(st) : -1;
+    }
+    if (to_ok) pthread_join(consumer.tid, NULL);
+    if (to_thread) rc = consumer.status;
+    if (relay > 0) waitpid(relay, NULL, 0);
+    if (ring > 0) waitpid(ring, NULL, 0);
+    if (spool > 0) ckpt_finish(p, spool, prod_status);
+    if (ckpt) munmap((void *)ckpt, ckpt_len);
+    return rc;
+}
+
+// run a concatenate by sequentially running each part into out_fd
+static int run_concat_into_fd(const Concat *c, int out_fd) {
+    double start = trace_now_us();
+    int rc = 0;
+    for (int i = 0; i < c->parts && rc == 0; i++) {
+        const char *name = c->part_name[i];
+        if (!name[0]) continue; // skip holes if parts came out-of-order in file
+
+        rc = run_component_into_fd(name, out_fd);
+    }
+    trace_span("concatenate", c->name, start, NULL);
+    return rc;
+}
+
+// Move n bytes that are still queued in src through a bounce buffer, giving each
+// destination only the bytes past what tee() already handed it (have[i])
+static int tee_bounce(int src, size_t n, const int dst[], const size_t have[], int live[], int count) {
+    char buf[TEE_CHUNK];
+    size_t off = 0;
+    while (off < n) {
+        size_t want = n - off < sizeof buf ? n - off : sizeof buf;
+        ssize_t r = read(src, buf, want);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) { perror("tee read"); return -1; }
+
+        for (int i = 0; i < count; i++) {
+            if (!live[i] || have[i] >= off + (size_t)r) continue;
+            size_t skip = have[i] > off ? have[i] - off : 0;
+            size_t done = skip;
+            while (done < (size_t)r) {
+                ssize_t w = write(dst[i], buf + done, (size_t)r - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w < 0) { live[i] = 0; break; } // consumer went away
+                done += (size_t)w;
+            }
+        }
+        off += (size_t)r;
+    }
+    return 0;
+}
+
+// Copy everything readable from src into every live destination pipe.
+// tee() duplicates pipe buffers without consuming them, the final splice() consumes
+// them, so the payload never enters user space. A full destination blocks the pump,
+// which in turn stops draining src: the slowest consumer sets the pace for all.
+static long long tee_pump(int src, const int dst[], int count) {
+    long long total = 0;
+    int live[MAX_PARTS];
+    size_t have[MAX_PARTS];
+    for (int i = 0; i < count; i++) live[i] = 1;
+
+    for (;;) {
+        int first = -1, last = -1, nlive = 0;
+        for (int i = 0; i < count; i++) {
+            if (!live[i]) continue;
+            if (first < 0) first = i;
+            last = i;
+            nlive++;
+        }
+        if (nlive == 0) return total; // nobody is listening anymore
+
+        if (nlive == 1) {
+            ssize_t m = splice(src, NULL, dst[last], NULL, TEE_CHUNK, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0) { live[last] = 0; continue; }
+            if (m == 0) return total; // EOF
+            total += m;
+            continue;
+        }
+
+        ssize_t n = tee(src, dst[first], TEE_CHUNK, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { live[first] = 0; continue; }
+        if (n == 0) return total; // EOF
+        total += n;
+
+        int short_copy = 0;
+        for (int i = 0; i < count; i++) {
+            have[i] = (size_t)n;
+            if (!live[i] || i == first || i == last) continue;
+
+            ssize_t k;
+            do { k = tee(src, dst[i], (size_t)n, 0); } while (k < 0 && errno == EINTR);
+            if (k < 0) { live[i] = 0; continue; }
+            // tee() can link fewer buffers than asked when the destination is nearly
+            // full and can't resume mid-stream, so the tail goes through tee_bounce()
+            if (k < n) { have[i] = (size_t)k; short_copy = 1; }
+        }
+
+        size_t moved = 0;
+        have[last] = 0;
+        while (!short_copy && live[last] && moved < (size_t)n) {
+            ssize_t m = splice(src, NULL, dst[last], NULL, (size_t)n - moved, SPLICE_F_MOVE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) { live[last] = 0; break; }
+            moved += (size_t)m;
+        }
+        have[last] = moved;
+
+        if (moved < (size_t)n) {
+            // rebase offsets onto what is still queued in src
+            for (int i = 0; i < count; i++) have[i] = have[i] > moved ? have[i] - moved : 0;
+            if (tee_bounce(src, (size_t)n - moved, dst, have, live, count) < 0) return total;
+        }
+    }
+}
+
+// run a tee by streaming t->from once and handing every part its own copy on stdin;
+// the parts all write into out_fd, so their output interleaves as they run
+static int run_tee_into_fd(const Tee *t, int out_fd) {
+    double start = trace_now_us();
+    int count = t->parts;
+    int in[2];
+    int fds[MAX_PARTS][2];
+    int dst[MAX_PARTS];
+    pid_t kids[MAX_PARTS];
+
+    if (open_pipe(in, 0) < 0) {
+        perror("pipe");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (pipe(fds[i]) < 0) {
+            perror("pipe");
+            for (int j = 0; j < i; j++) { close(fds[j][0]); close(fds[j][1]); }
+            close(in[0]); close(in[1]);
+            return -1;
+        }
+        // give each branch room to fall behind the others before it stalls them
+        fcntl(fds[i][1], F_SETPIPE_SZ, TEE_PIPE_SZ);
+        dst[i] = fds[i][1];
+    }
+
+    pid_t producer = fork();
+    if (producer < 0) {
+        perror("fork tee producer");
+        for (int j = 0; j < count; j++) { close(fds[j][0]); close(fds[j][1]); }
+        close(in[0]); close(in[1]);
+        return -1;
+    }
+    if (producer == 0) {
+        close(in[0]);
+        for (int j = 0; j < count; j++) { close(fds[j][0]); close(fds[j][1]); }
+        int rc = run_component_into_fd(t->from, in[1]);
+        close(in[1]);
+        _exit(rc < 0 ? 1 : rc);
+    }
+    close(in[1]);
+
+    for (int i = 0; i < count; i++) {
+        kids[i] = -1;
+        if (!t->part_name[i][0]) continue;
+
+        kids[i] = fork();
+        if (kids[i] == 0) {
+            close(in[0]);
+            if (dup2(fds[i][0], STDIN_FILENO) < 0) { perror("dup2 tee"); _exit(127); }
+            for (int j = 0; j < count; j++) { close(fds[j][0]); close(fds[j][1]); }
+            int rc = run_component_into_fd(t->part_name[i], out_fd);
+            _exit(rc == 0 ? 0 : 1);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        close(fds[i][0]);
+        if (kids[i] <= 0) { close(fds[i][1]); dst[i] = -1; }
+    }
+
+    // a consumer that quits early must not take the whole interpreter down with SIGPIPE
+    struct sigaction ign = {0}, old;
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &old);
+
+    int nd = 0, live_fds[MAX_PARTS];
+    for (int i = 0; i < count; i++) if (dst[i] >= 0) live_fds[nd++] = dst[i];
+    long long bytes = tee_pump(in[0], live_fds, nd);
+
+    sigaction(SIGPIPE, &old, NULL);
+
+    close(in[0]);
+    for (int i = 0; i < nd; i++) close(live_fds[i]);
+
+    // like a top-level pipe, a failing source wins over whatever the consumers report
+    int pst = 0; waitpid(producer, &pst, 0);
+    int result = (WIFEXITED(pst)? WEXITSTATUS(pst) : -1);
+    for (int i = 0; i < count; i++) {
+        if (kids[i] <= 0) continue;
+        int st = 0; waitpid(kids[i], &st, 0);
+        int rc = (WIFEXITED(st)? WEXITSTATUS(st) : -1);
+        if (result == 0 && rc != 0) result = rc;
+    }
+
+    char extra[64];
+    snprintf(extra, sizeof extra, "\"bytes\":%lld,\"consumers\":%d", bytes, nd);
+    trace_span("tee", t->name, start, extra);
+    return result;
+}
+
+/* PARALLEL MAP */
+
+typedef struct {
+    pid_t pid;          // 0 when the slot is free
+    long seq;           // position of this chunk in the input
+    int in_fd;          // write end of the worker's stdin, -1 once fully written
+    int out_fd;         // read end of the worker's stdout, -1 at EOF
+    char *in_buf; size_t in_len, in_off;
+    char *out_buf; size_t out_len, out_cap;
+    int status;
+    double start_us;
+} ParJob;
+
+// Length of the next chunk at the front of buf, or 0 if more input is needed to decide
+static size_t par_cut(const Parallel *par, const char *buf, size_t len, int eof) {
+    if (len >= par->chunk) {
+        if (par->split_bytes) return par->chunk;
+        const char *nl = memrchr(buf, '\n', par->chunk);
+        if (!nl) nl = memchr(buf + par->chunk, '\n', len - par->chunk); // one very long line
+        if (nl) return (size_t)(nl - buf) + 1;
+    }
+    return eof ? len : 0;
+}
+
+// Fork one worker instance for a chunk; it reads the chunk on stdin and we collect its stdout
+static int par_spawn(const Parallel *par, ParJob *job, ParJob jobs[], int nslots, int src) {
+    int in[2], out[2];
+    if (pipe(in) < 0) { perror("pipe"); return -1; }
+    if (pipe(out) < 0) { perror("pipe"); close(in[0]); close(in[1]); return -1; }
+
+    pid_t c = fork();
+    if (c < 0) {
+        perror("fork worker");
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        return -1;
+    }
+    if (c == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        close(src);
+        for (int i = 0; i < nslots; i++) {
+            if (!jobs[i].pid) continue;
+            if (jobs[i].in_fd >= 0) close(jobs[i].in_fd);
+            if (jobs[i].out_fd >= 0) close(jobs[i].out_fd);
+        }
+        dup2(in[0], STDIN_FILENO);
+        close(in[0]); close(in[1]); close(out[0]);
+
+        // a plain node is exec'd directly so every chunk costs one fork, not two
+        const Node *n = get_node_by_name(node_array, node_count, par->worker);
+        if (n) {
+            dup2(out[1], STDOUT_FILENO);
+            close(out[1]);
+            exec_node(n);
+        }
+        int rc = run_component_into_fd(par->worker, out[1]);
+        _exit(rc == 0 ? 0 : 1);
+    }
+
+    close(in[0]); close(out[1]);
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    job->pid = c;
+    job->start_us = trace_now_us();
+    job->in_fd = in[1];
+    job->out_fd = out[0];
+    return 0;
+}
+
+// run a parallel by cutting the output of par->from into chunks, running a fresh
+// par->worker per chunk with up to par->workers in flight, and writing each
+// chunk's output to out_fd whole (in input order unless ordered=0)
+static int run_parallel_into_fd(const Parallel *par, int out_fd) {
+    double start = trace_now_us();
+    long long bytes_in = 0, bytes_out = 0;
+    int nslots = par->workers > 0 ? par->workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nslots < 1) nslots = 1;
+    if (nslots > MAX_WORKERS) nslots = MAX_WORKERS;
+
+    int src[2];
+    if (open_pipe(src, 0) < 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t producer = fork();
+    if (producer < 0) {
+        perror("fork parallel producer");
+        close(src[0]); close(src[1]);
+        return -1;
+    }
+    if (producer == 0) {
+        close(src[0]);
+        int rc = run_component_into_fd(par->from, src[1]);
+        _exit(rc < 0 ? 1 : rc);
+    }
+    close(src[1]);
+    fcntl(src[0], F_SETFL, O_NONBLOCK);
+
+    // workers that stop reading early must not kill the interpreter
+    struct sigaction ign = {0}, old;
+    ign.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ign, &old);
+
+    ParJob jobs[MAX_WORKERS];
+    memset(jobs, 0, sizeof jobs);
+
+    char *pending = NULL;
+    size_t pending_len = 0, pending_cap = 0;
+    int src_eof = 0, failed = 0, result = 0;
+    long next_seq = 0, next_emit = 0;
+
+    for (;;) {
+        // hand out chunks while there are free slots
+        for (;;) {
+            int slot = -1;
+            for (int i = 0; i < nslots; i++) if (!jobs[i].pid) { slot = i; break; }
+            if (slot < 0 || failed) break;
+
+            size_t cut = par_cut(par, pending, pending_len, src_eof);
+            if (cut == 0) break;
+
+            ParJob *job = &jobs[slot];
+            memset(job, 0, sizeof *job);
+            job->in_buf = malloc(cut);
+            if (!job->in_buf) { fprintf(stderr, "out of memory\n"); failed = 1; break; }
+            memcpy(job->in_buf, pending, cut);
+            job->in_len = cut;
+            memmove(pending, pending + cut, pending_len - cut);
+            pending_len -= cut;
+
+            job->seq = next_seq++;
+            if (par_spawn(par, job, jobs, nslots, src[0]) < 0) {
+                free(job->in_buf);
+                memset(job, 0, sizeof *job);
+                failed = 1;
+                break;
+            }
+        }
+
+        int busy = 0;
+        for (int i = 0; i < nslots; i++) if (jobs[i].pid) busy = 1;
+        int want_input = !src_eof && !failed && par_cut(par, pending, pending_len, 0) == 0;
+        if (!busy && !want_input) break;
+
+        struct pollfd pfds[1 + 2 * MAX_WORKERS];
+        ParJob *owner[1 + 2 * MAX_WORKERS];
+        int np = 0;
+        if (want_input) {
+            pfds[np] = (struct pollfd){ .fd = src[0], .events = POLLIN };
+            owner[np++] = NULL;
+        }
+        for (int i = 0; i < nslots; i++) {
+            if (!jobs[i].pid) continue;
+            if (jobs[i].in_fd >= 0) {
+                pfds[np] = (struct pollfd){ .fd = jobs[i].in_fd, .events = POLLOUT };
+                owner[np++] = &jobs[i];
+            }
+            if (jobs[i].out_fd >= 0) {
+                pfds[np] = (struct pollfd){ .fd = jobs[i].out_fd, .events = POLLIN };
+                owner[np++] = &jobs[i];
+            }
+        }
+
+        if (np > 0 && poll(pfds, np, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            failed = 1;
+            break;
+        }
+
+        for (int k = 0; k < np; k++) {
+            if (!pfds[k].revents) continue;
+            ParJob *job = owner[k];
+
+            if (!job) {
+                if (pending_cap - pending_len < 64 * 1024) {
+                    size_t cap = pending_cap ? pending_cap * 2 : par->chunk + 64 * 1024;
+                    char *grown = realloc(pending, cap);
+                    if (!grown) { fprintf(stderr, "out of memory\n"); failed = 1; continue; }
+                    pending = grown;
+                    pending_cap = cap;
+                }
+                ssize_t r = read(src[0], pending + pending_len, pending_cap - pending_len);
+                if (r > 0) pending_len += (size_t)r;
+                else if (r == 0 || (errno != EAGAIN && errno != EINTR)) src_eof = 1;
+            } else if (pfds[k].fd == job->in_fd) {
+                ssize_t w = write(job->in_fd, job->in_buf + job->in_off, job->in_len - job->in_off);
+                if (w > 0) job->in_off += (size_t)w;
+                // EPIPE means the worker is done reading; either way stop feeding it
+                if ((w < 0 && errno != EAGAIN && errno != EINTR) || job->in_off == job->in_len) {
+                    close(job->in_fd);
+                    job->in_fd = -1;
+                    free(job->in_buf);
+                    job->in_buf = NULL;
+                }
+            } else {
+                if (job->out_cap - job->out_len < 64 * 1024) {
+                    size_t cap = job->out_cap ? job->out_cap * 2 : 128 * 1024;
+                    char *grown = realloc(job->out_buf, cap);
+                    if (!grown) { fprintf(stderr, "out of memory\n"); failed = 1; continue; }
+                    job->out_buf = grown;
+                    job->out_cap = cap;
+                }
+                ssize_t r = read(job->out_fd, job->out_buf + job->out_len, job->out_cap - job->out_len);
+                if (r > 0) job->out_len += (size_t)r;
+                else if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    close(job->out_fd);
+                    job->out_fd = -1;
+                }
+            }
+        }
+
+        // reap finished workers and emit whatever may go out now
+        for (;;) {
+            ParJob *ready = NULL;
+            for (int i = 0; i < nslots; i++) {
+                ParJob *job = &jobs[i];
+                if (!job->pid || job->in_fd >= 0 || job->out_fd >= 0) continue;
+                if (par->unordered || job->seq == next_emit) { ready = job; break; }
+            }
+            if (!ready) break;
+
+            char label[MAX_NAME_LEN + 24];
+            snprintf(label, sizeof label, "%s#%ld", par->worker, ready->seq);
+            const Node *wn = get_node_by_name(node_array, node_count, par->worker);
+            int st = wait_traced(ready->pid, label, wn ? wn->command : NULL, ready->start_us);
+            bytes_in += (long long)ready->in_len;
+            bytes_out += (long long)ready->out_len;
+            int rc = (WIFEXITED(st)? WEXITSTATUS(st) : -1);
+            if (result == 0 && rc != 0) result = rc;
+
+            if (!failed && write_all(out_fd, ready->out_buf, ready->out_len) < 0) {
+                perror("parallel write");
+                failed = 1;
+            }
+            if (ready->seq == next_emit) next_emit++;
+            free(ready->out_buf);
+            memset(ready, 0, sizeof *ready);
+        }
+    }
+
+    sigaction(SIGPIPE, &old, NULL);
+
+    for (int i = 0; i < nslots; i++) {
+        if (!jobs[i].pid) continue;
+        if (jobs[i].in_fd >= 0) close(jobs[i].in_fd);
+        if (jobs[i].out_fd >= 0) close(jobs[i].out_fd);
+        waitpid(jobs[i].pid, NULL, 0);
+        free(jobs[i].in_buf);
+        free(jobs[i].out_buf);
+    }
+    free(pending);
+    close(src[0]);
+    // a failing source means the workers only saw part of the input
+    int pst = 0; waitpid(producer, &pst, 0);
+    int prc = (WIFEXITED(pst)? WEXITSTATUS(pst) : -1);
+    if (prc != 0) result = prc;
+
+    char extra[96];
+    snprintf(extra, sizeof extra, "\"chunks\":%ld,\"bytes_in\":%lld,\"bytes_out\":%lld",
+             next_seq, bytes_in, bytes_out);
+    trace_span("parallel", par->name, start, extra);
+
+    if (failed && result == 0) result = -1;
+    return result;
+}
+
+/* INCREMENTAL */
+
+// -i skips work that is already done, like make. A component is considered when
+// some node under it declares outputs=. It is up to date when the signature of its
+// subgraph matches its last successful run in .flow-state, and every file it wrote
+// still hashes the same as it did then. The signature covers every component
+// definition, every command and the contents of every declared input. Such a
+// component isn't run at all and writes nothing to its output. Each finished
+// run appends one line to .flow-state with O_APPEND, so forked children record
+// their own runs too:
+//   name <TAB> signature <TAB> status [<TAB> path=hash]...
+// The file is compacted to one line per component when the run ends.
+
+#define STATE_FILE ".flow-state"
+
+typedef struct {
+    uint64_t sig;
+    int status;
+    char *outputs;     // "path=hash\t..." as recorded
+} StateEntry;
+
+static int incremental = 0;
+static int state_fd = -1;
+static StateEntry *state;              // per symbol, from the last runs
+static unsigned char *has_outputs;     // per symbol: some node below declares outputs=
+static unsigned *visit_mark;           // per symbol, for subgraph walks
+static unsigned visit_gen = 0;
+
+// Walk the subgraph under root (each component once, depth first, in a fixed
+// order) and call fn on every component in it
+static void walk_subgraph(int root, void (*fn)(int idx, void *ctx), void *ctx) {
+    if (!visit_mark) visit_mark = calloc((size_t)symbol_count + 1, sizeof *visit_mark);
+    int *stack = malloc((size_t)symbol_count * sizeof *stack);
+    if (!stack || !visit_mark) { fprintf(stderr, "out of memory\n"); exit(1); }
+    visit_gen++;
+    int sp = 0;
+    stack[sp++] = root;
+    visit_mark[root] = visit_gen;
+    while (sp > 0) {
+        int cur = stack[--sp];
+        fn(cur, ctx);
+        const char *refs[MAX_PARTS + 1];
+        int n = component_refs(&symbols[cur], refs);
+        for (int r = n - 1; r >= 0; r--) {
+            int dep = (int)(lookup(refs[r]) - symbols);
+            if (visit_mark[dep] == visit_gen) continue;
+            visit_mark[dep] = visit_gen;
+            stack[sp++] = dep;
+        }
+    }
+    free(stack);
+}
+
+// fold one component's definition into the signature; line numbers are left out
+// so moving a component around the file doesn't invalidate it
+static void sig_step(int idx, void *ctx) {
+    uint64_t *h = ctx;
+    const Symbol *s = &symbols[idx];
+    *h = fnv1a(*h, s->name, strlen(s->name) + 1);
+    *h = fnv1a(*h, &s->kind, sizeof s->kind);
+    switch (s->kind) {
+    case KIND_NODE: {
+        const Node *n = &node_array[s->index];
+        uint64_t key = node_cache_key(n);
+        *h = fnv1a(*h, &key, sizeof key);
+        *h = fnv1a(*h, n->outputs, strlen(n->outputs) + 1);
+        break;
+    }
+    case KIND_PIPE: {
+        Pipe p = pipe_array[s->index]; p.line = 0;
+        *h = fnv1a(*h, &p, sizeof p);
+        break;
+    }
+    case KIND_CONCAT: {
+        Concat c = concat_array[s->index]; c.line = 0;
+        *h = fnv1a(*h, &c, sizeof c);
+        break;
+    }
+    case KIND_STDERR: {
+        Stderr sd = stderr_array[s->index]; sd.line = 0;
+        *h = fnv1a(*h, &sd, sizeof sd);
+        break;
+    }
+    case KIND_TEE: {
+        Tee t = tee_array[s->index]; t.line = 0;
+        *h = fnv1a(*h, &t, sizeof t);
+        break;
+    }
+    case KIND_PARALLEL: {
+        Parallel par = parallel_array[s->index]; par.line = 0;
+        *h = fnv1a(*h, &par, sizeof par);
+        break;
+    }
+    case KIND_STREAMS: {
+        Streams st = streams_array[s->index]; st.line = 0;
+        *h = fnv1a(*h, &st, sizeof st);
+        break;
+    }
+    }
+}
+
+// hashed now rather than at load time, so inputs written earlier in this run count
+static uint64_t subgraph_sig(int idx) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    walk_subgraph(idx, sig_step, &h);
+    return h;
+}
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} LineBuf;
+
+static void line_append(LineBuf *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        while (cap < b->len + n + 1) cap *= 2;
+        char *grown = realloc(b->buf, cap);
+        if (!grown) { fprintf(stderr, "out of memory\n"); exit(1); }
+        b->buf = grown;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, s, n);
+    b->len += n;
+    b->buf[b->len] = '\0';
+}
+
+// add "<TAB>path=hash" for every output declared under this component
+static void outputs_step(int idx, void *ctx) {
+    if (symbols[idx].kind != KIND_NODE) return;
+    char outputs[CMD_LEN];
+    strcpy(outputs, node_array[symbols[idx].index].outputs);
+    char *save = NULL;
+    for (char *path = strtok_r(outputs, " \t", &save); path; path = strtok_r(NULL, " \t", &save)) {
+        char item[PATH_MAX + 32];
+        int len = snprintf(item, sizeof item, "\t%s=%016llx", path,
+                           (unsigned long long)hash_file(0xcbf29ce484222325ULL, path));
+        line_append(ctx, item, (size_t)len);
+    }
+}
+
+static int is_up_to_date(int idx) {
+    const StateEntry *e = &state[idx];
+    if (!e->outputs || e->status != 0 || e->sig != subgraph_sig(idx)) return 0;
+
+    // every recorded output must still be there, unchanged
+    char *copy = strdup(e->outputs);
+    if (!copy) return 0;
+    int ok = 1;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, "\t", &save); item && ok; item = strtok_r(NULL, "\t", &save)) {
+        char *eq = strrchr(item, '=');
+        if (!eq) { ok = 0; break; }
+        *eq = '\0';
+        ok = strtoull(eq + 1, NULL, 16) == hash_file(0xcbf29ce484222325ULL, item);
+    }
+    free(copy);
+    return ok;
+}
+
+static void record_run(int idx, uint64_t sig, int status) {
+    if (state_fd < 0) return;
+    LineBuf line = { 0 };
+    char head[MAX_NAME_LEN + 48];
+    int len = snprintf(head, sizeof head, "%s\t%016llx\t%d", symbols[idx].name, (unsigned long long)sig, status);
+    line_append(&line, head, (size_t)len);
+    if (status == 0) walk_subgraph(idx, outputs_step, &line);
+    line_append(&line, "\n", 1);
+    if (write_all(state_fd, line.buf, line.len) < 0) perror("write " STATE_FILE);
+    free(line.buf);
+}
+
+// read .flow-state into state[]; later lines win
+static void load_state_lines(const char *buf, size_t len) {
+    const char *end = buf + len;
+    for (const char *p = buf; p < end; ) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *eol = nl ? nl : end;
+        const char *t1 = memchr(p, '\t', (size_t)(eol - p));
+        if (t1 && (size_t)(t1 - p) < MAX_NAME_LEN) {
+            char name[MAX_NAME_LEN];
+            memcpy(name, p, (size_t)(t1 - p));
+            name[t1 - p] = '\0';
+            const Symbol *s = lookup(name);
+            char *rest = strndup(t1 + 1, (size_t)(eol - t1 - 1));
+            char *save = NULL;
+            char *sig = rest ? strtok_r(rest, "\t", &save) : NULL;
+            char *status = sig ? strtok_r(NULL, "\t", &save) : NULL;
+            if (s && status) {
+                StateEntry *e = &state[s - symbols];
+                free(e->outputs);
+                e->sig = strtoull(sig, NULL, 16);
+                e->status = atoi(status);
+                e->outputs = strdup(save ? save : "");
+            }
+            free(rest);
+        }
+        p = nl ? nl + 1 : end;
+    }
+}
+
+static int read_state_file(void) {
+    int fd = open(STATE_FILE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            load_state_lines(map, (size_t)st.st_size);
+            munmap(map, (size_t)st.st_size);
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+// mark the components -i can skip and load what the earlier runs recorded
+static int incremental_open(void) {
+    state = calloc((size_t)symbol_count + 1, sizeof *state);
+    has_outputs = calloc((size_t)symbol_count + 1, 1);
+    if (!state || !has_outputs) { fprintf(stderr, "out of memory\n"); exit(1); }
+
+    // a component has outputs if it is a node with outputs= or uses one that has;
+    // components are appended in post-order, so each one's refs are settled first
+    int *order = malloc(((size_t)symbol_count + 1) * sizeof *order);
+    unsigned char *seen = calloc((size_t)symbol_count + 1, 1);
+    int *stack = malloc(((size_t)symbol_count * 2 + 2) * sizeof *stack);
+    if (!order || !seen || !stack) { fprintf(stderr, "out of memory\n"); exit(1); }
+    int count = 0;
+    for (int root = 0; root < symbol_count; root++) {
+        if (seen[root]) continue;
+        int sp = 0;
+        stack[sp++] = root; stack[sp++] = 0;
+        seen[root] = 1;
+        while (sp > 0) {
+            int cur = stack[sp - 2];
+            const char *refs[MAX_PARTS + 1];
+            int n = component_refs(&symbols[cur], refs);
+            if (stack[sp - 1] >= n) { order[count++] = cur; sp -= 2; continue; }
+            int dep = (int)(lookup(refs[stack[sp - 1]++]) - symbols);
+            if (!seen[dep]) { seen[dep] = 1; stack[sp++] = dep; stack[sp++] = 0; }
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int idx = order[i];
+        const Symbol *s = &symbols[idx];
+        if (s->kind == KIND_NODE && node_array[s->index].outputs[0]) has_outputs[idx] = 1;
+        const char *refs[MAX_PARTS + 1];
+        int n = component_refs(s, refs);
+        for (int r = 0; r < n; r++) if (has_outputs[lookup(refs[r]) - symbols]) has_outputs[idx] = 1;
+    }
+    free(order); free(seen); free(stack);
+
+    if (read_state_file() < 0) { perror(STATE_FILE); return -1; }
+    state_fd = open(STATE_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (state_fd < 0) { perror(STATE_FILE); return -1; }
+    incremental = 1;
+    return 0;
+}
+
+// rewrite .flow-state with just the latest line for each component in the flow
+static void incremental_close(void) {
+    if (!incremental) return;
+    close(state_fd);
+    state_fd = -1;
+    for (int i = 0; i < symbol_count; i++) { free(state[i].outputs); state[i].outputs = NULL; }
+    read_state_file();
+
+    char tmp[] = STATE_FILE ".XXXXXX";
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) { perror("mkostemp"); return; }
+    int failed = 0;
+    for (int i = 0; i < symbol_count && !failed; i++) {
+        if (!state[i].outputs) continue;
+        char head[MAX_NAME_LEN + 48];
+        int len = snprintf(head, sizeof head, "%s\t%016llx\t%d", symbols[i].name,
+                           (unsigned long long)state[i].sig, state[i].status);
+        failed = write_all(fd, head, (size_t)len) < 0;
+        if (!failed && state[i].outputs[0]) {
+            failed = write_all(fd, "\t", 1) < 0 || write_all(fd, state[i].outputs, strlen(state[i].outputs)) < 0;
+        }
+        if (!failed) failed = write_all(fd, "\n", 1) < 0;
+    }
+    close(fd);
+    if (failed || rename(tmp, STATE_FILE) < 0) {
+        perror("rewrite " STATE_FILE);
+        unlink(tmp);
+    }
+}
+
+// Run a component through fn unless -i finds it up to date; record how it went
+static int run_incremental(const char *name, int (*fn)(const char *, int), int out_fd) {
+    const Symbol *s = incremental ? lookup(name) : NULL;
+    if (!s || !has_outputs[s - symbols]) return fn(name, out_fd);
+
+    int idx = (int)(s - symbols);
+    double start = trace_now_us();
+    if (is_up_to_date(idx)) {
+        fprintf(stderr, "'%s' is up to date\n", name);
+        trace_span("skip", name, start, NULL);
+        return 0;
+    }
+    uint64_t sig = subgraph_sig(idx);
+    int rc = fn(name, out_fd);
+    record_run(idx, sig, rc);
+    return rc;
+}
+
+// dispatch by kind (node, pipe, concatenate, stderr, tee, parallel, streams)
+static int dispatch_component(const char *name, int out_fd) {
+    const Node *n = get_node_by_name(node_array, node_count, name);
+    if (n) return run_node_into_fd(n, out_fd);
+
+    const Pipe *p = get_pipe_by_name(pipe_array, pipe_count, name);
+    if (p) return run_pipe_into_fd(p, out_fd);
+
+    const Concat *c = get_concat_by_name(concat_array, concat_count, name);
+    if (c) return run_concat_into_fd(c, out_fd);
+
+    const Stderr *sd = get_stderr_by_name(stderr_array, stderr_count, name);
+    if (sd) return run_stderr_into_fd(sd, out_fd);
+
+    const Tee *t = get_tee_by_name(tee_array, tee_count, name);
+    if (t) return run_tee_into_fd(t, out_fd);
+
+    const Parallel *par = get_parallel_by_name(parallel_array, parallel_count, name);
+    if (par) return run_parallel_into_fd(par, out_fd);
+
+    const Streams *st = get_streams_by_name(streams_array, streams_count, name);
+    if (st) return run_streams_into_fd(st, out_fd);
+
+    fprintf(stderr,"unknown component '%s'\n", name);
+    return -1;
+}
+
+static int run_component_into_fd(const char *name, int out_fd) {
+    return run_incremental(name, dispatch_component, out_fd);
+}
+
+/* DRIVER */
+
+// forget every component, so a flow file can be loaded again
+static void reset_flow(void) {
+    node_count = pipe_count = concat_count = stderr_count = tee_count = parallel_count = streams_count = 0;
+    symbol_count = 0;
+    if (symbol_slot_cap) memset(symbol_slots, -1, symbol_slot_cap * sizeof *symbol_slots);
+}
+
+// parse and check a .flow file; on any error the flow is left empty
+static int load_flow(const char *path) {
+    reset_flow();
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "unable to open file '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    int errors = 0;
+    if (st.st_size > 0) {
+        void *buf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buf == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+        errors = parse_flow(path, buf, (size_t)st.st_size);
+        munmap(buf, (size_t)st.st_size);
+    }
+    close(fd);
+
+    if (errors == 0) errors = validate_flow(path);
+    if (errors) {
+        fprintf(stderr, "%s: %d error%s\n", path, errors, errors == 1 ? "" : "s");
+        reset_flow();
+        return -1;
+    }
+    return 0;
+}
+
+// run the named top-level pipe with its consumer writing to out_fd
+static int run_target_into_fd(const char *pipeName, int out_fd) {
+    const Pipe *target_pipe = get_pipe_by_name(pipe_array, pipe_count, pipeName);
 
     if (target_pipe == NULL) {
         fprintf(stderr, "invalid pipe name");
@@ -444,48 +3253,564 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    ShmChain chain;
+    if (target_pipe->shm && shm_chain(target_pipe, &chain)) {
+        int rc = run_shm_chain(&chain, out_fd);
+        return rc < 0 ? 1 : rc;
+    }
+
     // create pipe for the connection
     int fd[2];
-    if (pipe(fd) < 0) {
+    if (open_pipe(fd, target_pipe->buffer) < 0) {
         perror("pipe");
         return 1;
     }
 
-    // Launch the consumer (to node) first
-    pid_t consumer = fork();
-    if (consumer == 0) {
-        dup2(fd[0], STDIN_FILENO);
+    int cons_fd = fd[0];
+    pid_t ring = 0;
+    if (target_pipe->ring) {
+        int others[] = { fd[1] };
+        ring = ring_relay(target_pipe->name, target_pipe->ring, &cons_fd, others, 1);
+    }
+
+    // Launch the consumer (to node) first; a builtin one runs on a thread
+    double start = trace_now_us();
+    BuiltinThread bt = { .n = to_node, .out_fd = out_fd, .close_in = 1 };
+    pid_t consumer = 0;
+    if (to_node->builtin) {
+        bt.in_fd = fcntl(cons_fd, F_DUPFD_CLOEXEC, 0);
+        if (start_builtin_thread(&bt) < 0) bt.n = NULL;
+    } else {
+        consumer = fork();
+    }
+    if (consumer == 0 && !to_node->builtin) {
+        dup2(cons_fd, STDIN_FILENO);
+        if (out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
         close(fd[1]); close(fd[0]);
-        execlp("sh","sh","-c", to_node->command, (char*)0);
-        perror("exec consumer");
-        _exit(127);
+        if (cons_fd != fd[0]) close(cons_fd);
+        exec_node(to_node);
     }
 
     // parent will produce into fd[1] using the dispatcher
     close(fd[0]);                // parent keeps only write end
-    int out_fd = fd[1];
-
-    // decide what "from" is and stream it into out_fd
-    int rc = -1;
-    const char *from_name = target_pipe->from;
-    
-    if (get_node_by_name(node_array, node_count, from_name)) {
-        rc = run_node_into_fd(get_node_by_name(node_array, node_count, from_name), out_fd);
-    } else if (get_pipe_by_name(pipe_array, pipe_count, from_name)) {
-        rc = run_pipe_into_fd(get_pipe_by_name(pipe_array, pipe_count, from_name), out_fd);
-    } else if (get_concat_by_name(concat_array, concat_count, from_name)) {
-        rc = run_concat_into_fd(get_concat_by_name(concat_array, concat_count, from_name), out_fd);
-    } else if (get_stderr_by_name(stderr_array, stderr_count, from_name)) {
-        rc = run_stderr_into_fd(get_stderr_by_name(stderr_array, stderr_count, from_name), out_fd);
+    if (cons_fd != fd[0]) close(cons_fd);
+    int prod_fd = fd[1];
+    size_t ckpt_len = 0;
+    const char *ckpt = target_pipe->checkpoint ? ckpt_map(target_pipe, &ckpt_len) : NULL;
+    pid_t spool = 0;
+    if (target_pipe->checkpoint && !ckpt) {
+        spool = ckpt_relay(target_pipe, &prod_fd, -1);
+        if (spool > 0) close(fd[1]);
+    }
+    int mid_fd = prod_fd;
+    pid_t relay = trace_relay(target_pipe->name, &prod_fd, -1);
+    if (relay > 0) close(mid_fd);
+
+    // decide what "from" is and stream it into the pipe, or replay its checkpoint
+    int rc;
+    if (ckpt) {
+        fprintf(stderr, "resuming '%s' from its checkpoint\n", target_pipe->name);
+        rc = ckpt_replay(target_pipe, ckpt, ckpt_len, prod_fd);
     } else {
-        fprintf(stderr,"unknown source '%s'\n", from_name);
-        rc = -1;
+        rc = run_component_into_fd(target_pipe->from, prod_fd);
     }
 
     // close write end so consumer sees EOF
-    close(out_fd);
+    close(prod_fd);
+
+    int status;
+    if (to_node->builtin) {
+        if (bt.n) pthread_join(bt.tid, NULL);
+        status = bt.status;
+    } else {
+        int st = wait_traced(consumer, to_node->name, to_node->command, start);
+        status = WIFEXITED(st)? WEXITSTATUS(st) : -1;
+    }
+    if (relay > 0) waitpid(relay, NULL, 0);
+    if (ring > 0) waitpid(ring, NULL, 0);
+    if (spool > 0) ckpt_finish(target_pipe, spool, rc);
+    if (ckpt) munmap((void *)ckpt, ckpt_len);
 
-    int st=0; waitpid(consumer, &st, 0);
     if (rc != 0) return rc;
-    return (WIFEXITED(st)? WEXITSTATUS(st) : -1);
-}
\ No newline at end of file
+    return status;
+}
+
+// run the named top-level pipe with its consumer writing to our STDOUT
+static int run_target(const char *pipeName) {
+    return run_incremental(pipeName, run_target_into_fd, STDOUT_FILENO);
+}
+
+/* SCHEDULER */
+
+// With several targets (or "all"), each target is a job running in its own child
+// with its output collected in a memfd. One epoll loop waits on a pidfd per running
+// job and starts the next one as soon as a slot frees up, so at most -j targets run
+// at once. Outputs are written in the order the targets were named, each as soon as
+// it and every target before it have finished.
+
+typedef struct {
+    const char *name;
+    pid_t pid;
+    int pidfd;
+    int out_fd;      // memfd holding what the target wrote
+    int status;
+    int done;
+    double start_us;
+} Job;
+
+// run one target: a pipe goes through run_target, anything else straight to stdout
+static int run_named(const char *name) {
+    if (get_pipe_by_name(pipe_array, pipe_count, name)) return run_target(name);
+    int rc = run_component_into_fd(name, STDOUT_FILENO);
+    return rc < 0 ? 1 : rc;
+}
+
+// "all" means every pipe and concatenate that no other component uses
+static int collect_all_targets(const char ***out) {
+    unsigned char *used = calloc((size_t)symbol_count + 1, 1);
+    const char **names = malloc(((size_t)symbol_count + 1) * sizeof *names);
+    if (!used || !names) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < symbol_count; i++) {
+        const char *refs[MAX_PARTS + 1];
+        int n = component_refs(&symbols[i], refs);
+        for (int r = 0; r < n; r++) used[lookup(refs[r]) - symbols] = 1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < symbol_count; i++) {
+        if (used[i]) continue;
+        if (symbols[i].kind == KIND_PIPE || symbols[i].kind == KIND_CONCAT) names[count++] = symbols[i].name;
+    }
+    free(used);
+    *out = names;
+    return count;
+}
+
+static int start_job(Job *job, int ep, int idx) {
+    job->out_fd = memfd_create(job->name, MFD_CLOEXEC);
+    if (job->out_fd < 0) { perror("memfd_create"); return -1; }
+
+    fflush(stdout);
+    job->start_us = trace_now_us();
+    job->pid = fork();
+    if (job->pid < 0) { perror("fork"); return -1; }
+    if (job->pid == 0) {
+        // jobs run side by side, so none of them gets to read the terminal
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull >= 0) { dup2(devnull, STDIN_FILENO); close(devnull); }
+        dup2(job->out_fd, STDOUT_FILENO);
+        int rc = run_named(job->name);
+        trace_span("target", job->name, job->start_us, NULL);
+        _exit(rc < 0 ? 1 : rc);
+    }
+
+    job->pidfd = (int)syscall(SYS_pidfd_open, job->pid, 0);
+    if (job->pidfd < 0) { perror("pidfd_open"); return -1; }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)idx };
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, job->pidfd, &ev) < 0) { perror("epoll_ctl"); return -1; }
+    return 0;
+}
+
+static int run_jobs(const char **names, int count, int slots) {
+    Job *jobs = calloc((size_t)count, sizeof *jobs);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (!jobs || ep < 0) {
+        perror("epoll_create1");
+        free(jobs);
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        jobs[i].name = names[i];
+        jobs[i].pidfd = jobs[i].out_fd = -1;
+    }
+
+    int next = 0, running = 0, emitted = 0, result = 0;
+    while (emitted < count) {
+        while (running < slots && next < count) {
+            Job *job = &jobs[next];
+            if (start_job(job, ep, next) < 0) {
+                // a job that never started still has to be reaped if it forked
+                if (job->pid > 0) waitpid(job->pid, NULL, 0);
+                job->status = 1;
+                job->done = 1;
+            } else {
+                running++;
+            }
+            next++;
+        }
+
+        if (running > 0) {
+            struct epoll_event evs[MAX_WORKERS];
+            int n = epoll_wait(ep, evs, MAX_WORKERS, -1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) { perror("epoll_wait"); break; }
+
+            for (int e = 0; e < n; e++) {
+                Job *job = &jobs[evs[e].data.u32];
+                siginfo_t si;
+                memset(&si, 0, sizeof si);
+                while (waitid(P_PID, (id_t)job->pid, &si, WEXITED) < 0 && errno == EINTR) {}
+                job->status = si.si_code == CLD_EXITED ? si.si_status : 1;
+                job->done = 1;
+                epoll_ctl(ep, EPOLL_CTL_DEL, job->pidfd, NULL);
+                close(job->pidfd);
+                running--;
+            }
+        }
+
+        // write out every finished target whose predecessors are all written
+        while (emitted < count && jobs[emitted].done) {
+            Job *job = &jobs[emitted++];
+            printf("Pipe Name: %s\n", job->name);
+            fflush(stdout);
+            if (job->out_fd >= 0) {
+                lseek(job->out_fd, 0, SEEK_SET);
+                if (copy_file_to_fd(job->out_fd, STDOUT_FILENO) < 0) perror("write output");
+                close(job->out_fd);
+            }
+            if (job->status != 0) {
+                fprintf(stderr, "target '%s' failed with status %d\n", job->name, job->status);
+                if (result == 0) result = job->status;
+            }
+        }
+    }
+
+    close(ep);
+    free(jobs);
+    return result;
+}
+
+/* SERVER */
+
+// -s runs a daemon that parses the flow file once and keeps a pool of pre-forked
+// workers blocked in accept() on a Unix socket. -c is the matching client: it
+// passes its stdin/stdout/stderr over the socket with SCM_RIGHTS, so the worker
+// runs the pipe straight into the caller's terminal or pipe, and exits with the
+// status the worker sends back.
+
+static volatile sig_atomic_t worker_stop = 0;
+
+static void on_worker_term(int sig) {
+    (void)sig;
+    worker_stop = 1;
+}
+
+// receive one request: the pipe name plus the client's three standard fds
+static int recv_request(int conn, char name[MAX_NAME_LEN], int fds[3]) {
+    char ctrl[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { .iov_base = name, .iov_len = MAX_NAME_LEN - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl, .msg_controllen = sizeof ctrl };
+
+    memset(name, 0, MAX_NAME_LEN);
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return -1;
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (!cm || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        fprintf(stderr, "flow server: request without file descriptors\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), 3 * sizeof(int));
+    return 0;
+}
+
+// serve requests until told to stop; runs in a pre-forked worker
+static void worker_loop(int listen_fd) {
+    struct sigaction idle = {0}, busy = {0};
+    idle.sa_handler = on_worker_term;  // no SA_RESTART: accept() must wake up
+    busy.sa_handler = on_worker_term;  // while running, waitpid() and friends must not
+    busy.sa_flags = SA_RESTART;
+
+    while (!worker_stop) {
+        sigaction(SIGTERM, &idle, NULL);
+        if (worker_stop) break;
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        sigaction(SIGTERM, &busy, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            _exit(1);
+        }
+
+        char name[MAX_NAME_LEN];
+        int fds[3];
+        if (recv_request(conn, name, fds) == 0) {
+            // the request's stdio replaces ours for the duration of the run
+            int saved[3];
+            for (int i = 0; i < 3; i++) {
+                saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+                dup2(fds[i], i);
+                close(fds[i]);
+            }
+
+            int rc = run_target(name);
+
+            fflush(stdout); fflush(stderr);
+            for (int i = 0; i < 3; i++) {
+                dup2(saved[i], i);
+                close(saved[i]);
+            }
+            if (send(conn, &rc, sizeof rc, MSG_NOSIGNAL) < 0) { /* client went away */ }
+        }
+        close(conn);
+    }
+    _exit(0);
+}
+
+static pid_t spawn_worker(int listen_fd, const sigset_t *old_mask) {
+    pid_t c = fork();
+    if (c < 0) { perror("fork worker"); return -1; }
+    if (c == 0) {
+        sigprocmask(SIG_SETMASK, old_mask, NULL);
+        worker_loop(listen_fd);
+    }
+    return c;
+}
+
+// parse a changed flow file in a throwaway child, so a broken edit reports its
+// errors without wiping the flow the server is already running
+static int flow_is_valid(const char *flow_path) {
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return 0; }
+    if (pid == 0) _exit(load_flow(flow_path) < 0 ? 1 : 0);
+
+    int st = 0;
+    while (waitpid(pid, &st, 0) < 0 && errno == EINTR) {}
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0;
+}
+
+static int serve_flow(const char *sock_path, const char *flow_path, int nworkers) {
+    if (load_flow(flow_path) < 0) return 1;
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) { perror("socket"); return 1; }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sock_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, sock_path);
+    unlink(sock_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(listen_fd, 64) < 0) {
+        perror(sock_path);
+        return 1;
+    }
+
+    // watch the directory, since editors usually replace the file rather than write it
+    char dir[PATH_MAX];
+    strncpy(dir, flow_path, sizeof dir - 1);
+    dir[sizeof dir - 1] = '\0';
+    char *slash = strrchr(dir, '/');
+    const char *base = slash ? slash + 1 : flow_path;
+    if (slash) *slash = '\0'; else strcpy(dir, ".");
+    int ino = inotify_init1(IN_CLOEXEC);
+    if (ino < 0 || inotify_add_watch(ino, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        perror("inotify");
+        return 1;
+    }
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd < 0) { perror("signalfd"); return 1; }
+
+    pid_t workers[MAX_WORKERS];
+    for (int i = 0; i < nworkers; i++) workers[i] = spawn_worker(listen_fd, &old_mask);
+
+    int running = 1;
+    while (running) {
+        struct pollfd pfds[2] = { { .fd = sfd, .events = POLLIN }, { .fd = ino, .events = POLLIN } };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        if (pfds[0].revents) {
+            struct signalfd_siginfo si;
+            if (read(sfd, &si, sizeof si) != sizeof si) continue;
+            if (si.ssi_signo != SIGCHLD) { running = 0; break; }
+
+            // replace current workers that died; retired ones are just reaped
+            pid_t dead;
+            while ((dead = waitpid(-1, NULL, WNOHANG)) > 0) {
+                for (int i = 0; i < nworkers; i++) {
+                    if (workers[i] == dead) workers[i] = spawn_worker(listen_fd, &old_mask);
+                }
+            }
+        }
+
+        if (pfds[1].revents) {
+            char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len = read(ino, evbuf, sizeof evbuf);
+            int changed = 0;
+            for (char *p = evbuf; len > 0 && p < evbuf + len; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                if (ev->len && strcmp(ev->name, base) == 0) changed = 1;
+                p += sizeof *ev + ev->len;
+            }
+            if (!changed || !flow_is_valid(flow_path) || load_flow(flow_path) < 0) continue;
+
+            // retire the old generation (each finishes its current request first)
+            // and start a new one that inherits the freshly parsed flow
+            fprintf(stderr, "flow server: reloaded %s\n", flow_path);
+            for (int i = 0; i < nworkers; i++) {
+                if (workers[i] > 0) kill(workers[i], SIGTERM);
+                workers[i] = spawn_worker(listen_fd, &old_mask);
+            }
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++) if (workers[i] > 0) kill(workers[i], SIGTERM);
+    while (waitpid(-1, NULL, 0) > 0) {}
+    unlink(sock_path);
+    return 0;
+}
+
+// ask a running server to execute pipeName with our stdio; returns its exit status
+static int request_flow(const char *sock_path, const char *pipeName) {
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn < 0) { perror("socket"); return 1; }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, sock_path, sizeof addr.sun_path - 1);
+    if (connect(conn, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        perror(sock_path);
+        return 1;
+    }
+
+    char name[MAX_NAME_LEN] = {0};
+    strncpy(name, pipeName, MAX_NAME_LEN - 1);
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char ctrl[CMSG_SPACE(sizeof fds)];
+    memset(ctrl, 0, sizeof ctrl);
+    struct iovec iov = { .iov_base = name, .iov_len = strlen(name) + 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctrl, .msg_controllen = sizeof ctrl };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cm), fds, sizeof fds);
+
+    if (sendmsg(conn, &msg, 0) < 0) {
+        perror("sendmsg");
+        return 1;
+    }
+
+    int rc = 1;
+    ssize_t n;
+    while ((n = read(conn, &rc, sizeof rc)) < 0 && errno == EINTR) {}
+    close(conn);
+    if (n != sizeof rc) {
+        fprintf(stderr, "flow server closed the connection\n");
+        return 1;
+    }
+    return rc;
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_path = NULL;
+    const char *serve_path = NULL;
+    const char *client_path = NULL;
+    int nworkers = 4;
+    int use_state = 0;
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "it:s:c:w:j:b:")) != -1) {
+        if (opt == 't') trace_path = optarg;
+        else if (opt == 'i') use_state = 1;
+        else if (opt == 'j') jobs = atoi(optarg);
+        else if (opt == 'b') pipe_buffer = (size_t)atol(optarg);
+        else if (opt == 's') serve_path = optarg;
+        else if (opt == 'c') client_path = optarg;
+        else if (opt == 'w') nworkers = atoi(optarg);
+        else {
+            fprintf(stderr, "usage: %s [-i] [-t trace.json] [-j jobs] [-b pipe_bytes] <flowfile> <target>... | all\n"
+                            "       %s -s <socket> [-w workers] <flowfile>\n"
+                            "       %s -c <socket> <pipe_name>\n", argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+
+    if (client_path) {
+        if (argc - optind < 1) {
+            fprintf(stderr, "usage: %s -c <socket> <pipe_name>\n", argv[0]);
+            return 1;
+        }
+        return request_flow(client_path, argv[optind]);
+    }
+
+    if (argc - optind < 1) {
+        fprintf(stderr, "usage: %s [-i] [-t trace.json] [-j jobs] [-b pipe_bytes] <flowfile> <target>... | all\n", argv[0]);
+        return 1;
+    }
+
+    if (serve_path) {
+        if (nworkers < 1) nworkers = 1;
+        if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+        return serve_flow(serve_path, argv[optind], nworkers);
+    }
+
+    if (load_flow(argv[optind]) < 0) {
+        return 1;
+    }
+
+    if (argc - optind < 2) {
+        fprintf(stderr, "usage: %s [-i] [-t trace.json] [-j jobs] [-b pipe_bytes] <flowfile> <target>... | all\n", argv[0]);
+        return 1;
+    }
+
+    if (use_state && incremental_open() < 0) {
+        return 1;
+    }
+
+    const char *pipeName = argv[optind + 1];
+
+    // several targets, or "all", go through the scheduler
+    const char **targets = (const char **)&argv[optind + 1];
+    int ntargets = argc - optind - 1;
+    int all = ntargets == 1 && strcmp(pipeName, "all") == 0 && !lookup("all");
+    if (all) ntargets = collect_all_targets(&targets);
+
+    if (ntargets > 1 || all) {
+        for (int i = 0; i < ntargets; i++) {
+            if (!lookup(targets[i])) {
+                fprintf(stderr, "unknown target '%s'\n", targets[i]);
+                return 1;
+            }
+        }
+        if (jobs < 1) jobs = 1;
+        if (jobs > MAX_WORKERS) jobs = MAX_WORKERS;
+
+        if (trace_path && trace_open(trace_path) < 0) {
+            return 1;
+        }
+        int rc = run_jobs(targets, ntargets, jobs);
+        trace_span("flow", all ? "all" : "targets", 0, NULL);
+        trace_close();
+        incremental_close();
+        if (rc == 0) ckpt_clear();
+        return rc;
+    }
+
+    printf("Pipe Name: %s", pipeName);
+
+    if (trace_path && trace_open(trace_path) < 0) {
+        return 1;
+    }
+
+    int rc = run_target(pipeName);
+
+    trace_span("flow", pipeName, 0, NULL);
+    trace_close();
+    incremental_close();
+    if (rc == 0) ckpt_clear();
+    return rc;
+}
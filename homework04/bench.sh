@@ -0,0 +1,42 @@
+#!/bin/sh
+# Compare insert and lookup scaling of the hashtable variants and the skiplist.
+#
+#   [MISS=percent] ./bench.sh [threads...]        (default: 1 2 4 8 12)
+#
+# Every program is built fresh with -O2 and run once per thread count. The
+# output is one markdown table per program, in the layout the README uses.
+# Programs this machine can't build (parallel_spin on MacOS) are skipped.
+# parallel_bloom looks up MISS percent (default 50) keys that were never
+# inserted, and times its get phase with and without the filter.
+
+THREADS=${*:-1 2 4 8 12}
+MISS=${MISS:-50}
+PROGRAMS="parallel_mutex parallel_spin parallel_mutex_opt parallel_skiplist parallel_bloom"
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for prog in $PROGRAMS; do
+    if ! gcc -O2 -pthread -o "$TMP/$prog" "$DIR/$prog.c" 2>/dev/null; then
+        echo "($prog does not build here, skipped)"
+        echo
+        continue
+    fi
+
+    echo "**$prog**"
+    echo
+    echo "| Num Threads | Time To Insert | Time to Retrieve | % Retrieved | Time to Scan | Without Filter |"
+    echo "|-------------|----------------|------------------|-------------|--------------|----------------|"
+    for t in $THREADS; do
+        extra=
+        [ "$prog" = parallel_bloom ] && extra=$MISS
+        "$TMP/$prog" "$t" $extra | awk -v t="$t" '
+            /Inserted/  { ins = $(NF - 1) }
+            /Retrieved/ { split($3, got, "/"); pct = int(100 * got[1] / got[2]); get = $(NF - 1) }
+            /Scanned/   { scan = $(NF - 1) }
+            /Without/   { unf = $(NF - 1) }
+            END { printf "| %-11s | %-14s | %-16s | %-11s | %-12s | %-14s |\n", t, ins, get, pct "%", scan ? scan : "-", unf ? unf : "-" }'
+    done
+    echo
+done
@@ -0,0 +1,278 @@
+// Bucket mutex hashtable with a blocked Bloom filter in front of retrieve()
+//
+// A key that isn't in the table costs a walk of its whole bucket, about 20k nodes
+// with NUM_BUCKETS 5. The filter answers "definitely absent" for most such keys
+// from one 64-byte block: insert() sets BLOOM_BITS bits of the key's block with
+// atomic fetch-or, and retrieve() only walks the chain if all of them are set.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define NUM_BUCKETS 5     // Buckets in hash table
+#define NUM_KEYS 100000   // Number of keys inserted per thread
+#define BLOOM_BLOCKS 2048 // 64-byte blocks: about 10 bits per key
+#define BLOOM_BITS 4      // bits set per key, all in the key's block
+
+int num_threads = 1;      // Number of threads (configurable)
+int miss_percent = 0;     // Share of lookups for keys that were never inserted
+int keys[NUM_KEYS];
+int lookups[NUM_KEYS];    // What get_phase looks up
+char absent[NUM_KEYS];    // lookups[i] is not in keys[]
+
+typedef struct _bucket_entry {
+  int key;
+  int val;
+  struct _bucket_entry *next;
+} bucket_entry;
+
+bucket_entry *table[NUM_BUCKETS];
+
+pthread_mutex_t *mutexes;
+
+// One cache line: a key's bits never leave its block
+typedef struct {
+  uint64_t word[8];
+} __attribute__((aligned(64))) bloom_block;
+
+bloom_block *bloom;
+int use_filter = 1;
+long *passed;             // per thread: absent keys the filter let through
+
+void panic(char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Mixes the key into 64 bits: the top bits pick the block, the low 36 the bits
+uint64_t bloom_hash(int key) {
+  uint64_t h = (uint64_t)(unsigned) key * 0x9E3779B97F4A7C15ULL;
+  return h ^ (h >> 29);
+}
+
+void bloom_add(int key) {
+  uint64_t h = bloom_hash(key);
+  bloom_block *b = &bloom[h >> 53 & (BLOOM_BLOCKS - 1)];
+  int k;
+  for (k = 0; k < BLOOM_BITS; k++) {
+    unsigned bit = (h >> (9 * k)) & 511;
+    __atomic_fetch_or(&b->word[bit >> 6], 1ULL << (bit & 63), __ATOMIC_RELEASE);
+  }
+}
+
+// 0 if key was never added; 1 if it may have been
+int bloom_maybe(int key) {
+  uint64_t h = bloom_hash(key);
+  const bloom_block *b = &bloom[h >> 53 & (BLOOM_BLOCKS - 1)];
+  int k;
+  for (k = 0; k < BLOOM_BITS; k++) {
+    unsigned bit = (h >> (9 * k)) & 511;
+    if (!(__atomic_load_n(&b->word[bit >> 6], __ATOMIC_ACQUIRE) & (1ULL << (bit & 63)))) return 0;
+  }
+  return 1;
+}
+
+// Inserts a key-value pair into the table
+void insert(int key, int val) {
+  int i = key % NUM_BUCKETS;
+
+  bucket_entry *e = (bucket_entry *) malloc(sizeof(bucket_entry));
+  if (!e) panic("No memory to allocate bucket!");
+
+  // set the bits before the entry is reachable, so the filter never hides a key
+  // a concurrent retrieve() could find
+  bloom_add(key);
+
+  pthread_mutex_lock(&mutexes[i]);
+  e->next = table[i];
+  e->key = key;
+  e->val = val;
+  table[i] = e;
+  pthread_mutex_unlock(&mutexes[i]);
+}
+
+// Retrieves an entry from the hash table by key
+// Returns NULL if the key isn't found in the table
+bucket_entry * retrieve(int key) {
+  bucket_entry *b;
+  if (use_filter && !bloom_maybe(key)) return NULL;
+  for (b = table[key % NUM_BUCKETS]; b != NULL; b = b->next) {
+    if (b->key == key) return b;
+  }
+  return NULL;
+}
+
+void * put_phase(void *arg) {
+  long tid = (long) arg;
+  int key = 0;
+
+  // If there are k threads, thread i inserts
+  //      (i, i), (i+k, i), (i+k*2)
+  for (key = tid ; key < NUM_KEYS; key += num_threads) {
+    insert(keys[key], tid);
+  }
+
+  pthread_exit(NULL);
+}
+
+// Looks up lookups[]; only a present key that isn't found counts as lost
+void * get_phase(void *arg) {
+  long tid = (long) arg;
+  int key = 0;
+  long lost = 0;
+
+  for (key = tid ; key < NUM_KEYS; key += num_threads) {
+    if (absent[key]) {
+      if (use_filter && bloom_maybe(lookups[key])) passed[tid]++;
+      if (retrieve(lookups[key]) != NULL) panic("found a key that was never inserted");
+    } else if (retrieve(lookups[key]) == NULL) {
+      lost++;
+    }
+  }
+  printf("[thread %ld] %ld keys lost!\n", tid, lost);
+
+  pthread_exit((void *)lost);
+}
+
+int compare_ints(const void *a, const void *b) {
+  int x = *(const int *) a, y = *(const int *) b;
+  return (x > y) - (x < y);
+}
+
+// Replaces about miss_percent of the lookups with keys that are not in keys[]
+long make_lookups() {
+  int *sorted = (int *) malloc(sizeof(int) * NUM_KEYS);
+  if (!sorted) panic("out of memory sorting keys");
+  memcpy(sorted, keys, sizeof(int) * NUM_KEYS);
+  qsort(sorted, NUM_KEYS, sizeof(int), compare_ints);
+
+  long misses = 0;
+  int i;
+  for (i = 0; i < NUM_KEYS; i++) {
+    lookups[i] = keys[i];
+    absent[i] = 0;
+    if (random() % 100 >= miss_percent) continue;
+
+    int k;
+    do {
+      k = random();
+    } while (bsearch(&k, sorted, NUM_KEYS, sizeof(int), compare_ints));
+    lookups[i] = k;
+    absent[i] = 1;
+    misses++;
+  }
+  free(sorted);
+  return misses;
+}
+
+// Runs get_phase on every thread; returns the seconds it took and sets *lost
+double run_get_phase(pthread_t *threads, long *lost) {
+  long i;
+  double start = now();
+  memset(threads, 0, sizeof(pthread_t)*num_threads);
+  memset(passed, 0, sizeof(long) * num_threads);
+  for (i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, get_phase, (void *)i);
+  }
+
+  *lost = 0;
+  for (i = 0; i < num_threads; i++) {
+    long n;
+    pthread_join(threads[i], (void **)&n);
+    *lost += n;
+  }
+  return now() - start;
+}
+
+int main(int argc, char **argv) {
+  long i;
+  pthread_t *threads;
+  double start, end;
+
+  if (argc != 2 && argc != 3) {
+    panic("usage: ./parallel_bloom <num_threads> [miss_percent]");
+  }
+  if ((num_threads = atoi(argv[1])) <= 0) {
+    panic("must enter a valid number of threads to run");
+  }
+  if (argc == 3 && ((miss_percent = atoi(argv[2])) < 0 || miss_percent > 100)) {
+    panic("miss_percent must be from 0 to 100");
+  }
+
+  srandom(time(NULL));
+
+  for (i = 0; i < NUM_KEYS; i++)
+    keys[i] = random();
+
+  long misses = make_lookups();
+
+  bloom = (bloom_block *) aligned_alloc(64, sizeof(bloom_block) * BLOOM_BLOCKS);
+  passed = (long *) calloc(num_threads, sizeof(long));
+  if (!bloom || !passed) {
+    panic("out of memory allocating the filter");
+  }
+  memset(bloom, 0, sizeof(bloom_block) * BLOOM_BLOCKS);
+
+  // init mutexes and populate array
+
+  mutexes = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t) * NUM_BUCKETS);
+  
+  if (!mutexes) {
+    panic("out of memory allocating mutex handles");
+  }
+
+  for (i = 0; i < NUM_BUCKETS; i++) {
+    pthread_mutex_init(&mutexes[i], NULL);
+  }
+
+  // init threads
+
+  threads = (pthread_t *) malloc(sizeof(pthread_t)*num_threads);
+
+  if (!threads) {
+    panic("out of memory allocating thread handles");
+  }
+
+  // Insert keys in parallel
+  start = now();
+  for (i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, put_phase, (void *)i);
+  }
+
+  // Barrier
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  end = now();
+
+  printf("[main] Inserted %d keys in %f seconds\n", NUM_KEYS, end - start);
+
+  // Retrieve keys in parallel, with the filter and then without it
+  long lost, total_passed = 0;
+  double with_filter = run_get_phase(threads, &lost);
+  for (i = 0; i < num_threads; i++) total_passed += passed[i];
+
+  printf("[main] Retrieved %ld/%ld keys in %f seconds\n", NUM_KEYS - misses - lost, NUM_KEYS - misses, with_filter);
+  printf("[main] Filter rejected %ld/%ld absent keys\n", misses - total_passed, misses);
+
+  use_filter = 0;
+  double without_filter = run_get_phase(threads, &lost);
+  printf("[main] Without the filter: %f seconds\n", without_filter);
+
+  for (i = 0; i < NUM_BUCKETS; i++) {
+    pthread_mutex_destroy(&mutexes[i]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,268 @@
+// Lock-free skiplist version of the hashtable harness
+//
+// The buckets only answer point lookups, and their chains are unordered, so a
+// range scan would have to walk every bucket. This keeps the same keys in a
+// skiplist instead: every level is a sorted linked list, and inserts link new
+// nodes in with compare-and-swap, so no thread ever holds a lock. Nodes are never
+// removed, which is what keeps CAS alone enough (no marking, no reclamation).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+
+#define NUM_KEYS 100000   // Number of keys inserted per thread
+#define MAX_LEVEL 20      // 2^20 > NUM_KEYS, so the top levels stay sparse
+#define NUM_RANGES 1000   // range() queries the key space is split into
+
+int num_threads = 1;      // Number of threads (configurable)
+int keys[NUM_KEYS];
+
+typedef struct _skip_node {
+  int key;
+  int val;
+  int level;                    // number of lists this node is linked into
+  struct _skip_node *next[];    // next[l] is the successor in list l
+} skip_node;
+
+skip_node *head;                // sentinel before every key, in all MAX_LEVEL lists
+
+void panic(char *msg) {
+  printf("%s\n", msg);
+  exit(1);
+}
+
+double now() {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Each level up holds about half the nodes of the one below
+int random_level(unsigned *seed) {
+  int level = 1;
+  while (level < MAX_LEVEL && (rand_r(seed) & 1)) level++;
+  return level;
+}
+
+// Finds, in every list, the last node before key and the first one at or after it.
+// Returns 1 if key is already in the skiplist.
+int find(int key, skip_node **preds, skip_node **succs) {
+  skip_node *pred = head;
+  int l;
+  for (l = MAX_LEVEL - 1; l >= 0; l--) {
+    skip_node *curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+    while (curr && curr->key < key) {
+      pred = curr;
+      curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+    }
+    preds[l] = pred;
+    succs[l] = curr;
+  }
+  return succs[0] && succs[0]->key == key;
+}
+
+// Inserts a key-value pair into the skiplist. A key that is already there keeps
+// its first value, the way retrieve() on the buckets finds only the newest one.
+void insert(int key, int val, unsigned *seed) {
+  skip_node *preds[MAX_LEVEL], *succs[MAX_LEVEL];
+  int level = random_level(seed);
+  int l;
+
+  skip_node *e = (skip_node *) malloc(sizeof(skip_node) + level * sizeof(skip_node *));
+  if (!e) panic("No memory to allocate skiplist node!");
+  e->key = key;
+  e->val = val;
+  e->level = level;
+
+  // Linking into the bottom list is what makes the key present. If another thread
+  // changed preds[0]->next[0] since find(), look again and retry.
+  for (;;) {
+    if (find(key, preds, succs)) {
+      free(e);
+      return;
+    }
+    for (l = 0; l < level; l++) e->next[l] = succs[l];
+    if (__atomic_compare_exchange_n(&preds[0]->next[0], &succs[0], e, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) break;
+  }
+
+  // The upper lists are only shortcuts, so they can be linked one at a time
+  for (l = 1; l < level; l++) {
+    for (;;) {
+      skip_node *expected = succs[l];
+      e->next[l] = expected;
+      if (__atomic_compare_exchange_n(&preds[l]->next[l], &expected, e, 0,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) break;
+      find(key, preds, succs);
+    }
+  }
+}
+
+// Retrieves an entry from the skiplist by key
+// Returns NULL if the key isn't found
+skip_node * retrieve(int key) {
+  skip_node *pred = head, *curr = NULL;
+  int l;
+  for (l = MAX_LEVEL - 1; l >= 0; l--) {
+    curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+    while (curr && curr->key < key) {
+      pred = curr;
+      curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+    }
+  }
+  return curr && curr->key == key ? curr : NULL;
+}
+
+// Counts the keys in [lo, hi): one descent to lo, then a walk along the bottom list
+long range(long lo, long hi) {
+  skip_node *pred = head, *curr;
+  long count = 0;
+  int l;
+  for (l = MAX_LEVEL - 1; l >= 0; l--) {
+    curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+    while (curr && curr->key < lo) {
+      pred = curr;
+      curr = __atomic_load_n(&pred->next[l], __ATOMIC_ACQUIRE);
+    }
+  }
+  int last = -1;
+  for (curr = __atomic_load_n(&pred->next[0], __ATOMIC_ACQUIRE);
+       curr && curr->key < hi;
+       curr = __atomic_load_n(&curr->next[0], __ATOMIC_ACQUIRE)) {
+    assert(curr->key > last);
+    last = curr->key;
+    count++;
+  }
+  return count;
+}
+
+void * put_phase(void *arg) {
+  long tid = (long) arg;
+  int key = 0;
+  unsigned seed = (unsigned) time(NULL) ^ (unsigned) (tid * 2654435761u);
+
+  // If there are k threads, thread i inserts
+  //      (i, i), (i+k, i), (i+k*2)
+  for (key = tid ; key < NUM_KEYS; key += num_threads) {
+    insert(keys[key], tid, &seed);
+  }
+
+  pthread_exit(NULL);
+}
+
+void * get_phase(void *arg) {
+  long tid = (long) arg;
+  int key = 0;
+  long lost = 0;
+
+  for (key = tid ; key < NUM_KEYS; key += num_threads) {
+    if (retrieve(keys[key]) == NULL) lost++;
+  }
+  printf("[thread %ld] %ld keys lost!\n", tid, lost);
+
+  pthread_exit((void *)lost);
+}
+
+// The key space [0, RAND_MAX] is cut into NUM_RANGES slices, dealt out to the
+// threads the same way put_phase deals out keys
+void * range_phase(void *arg) {
+  long tid = (long) arg;
+  long span = ((long) RAND_MAX + NUM_RANGES) / NUM_RANGES;
+  long found = 0;
+  int r;
+
+  for (r = tid; r < NUM_RANGES; r += num_threads) {
+    found += range(r * span, (r + 1) * span);
+  }
+
+  pthread_exit((void *)found);
+}
+
+int main(int argc, char **argv) {
+  long i;
+  pthread_t *threads;
+  double start, end;
+
+  if (argc != 2) {
+    panic("usage: ./parallel_skiplist <num_threads>");
+  }
+  if ((num_threads = atoi(argv[1])) <= 0) {
+    panic("must enter a valid number of threads to run");
+  }
+
+  srandom(time(NULL));
+
+  for (i = 0; i < NUM_KEYS; i++)
+    keys[i] = random();
+
+  head = (skip_node *) calloc(1, sizeof(skip_node) + MAX_LEVEL * sizeof(skip_node *));
+  if (!head) {
+    panic("out of memory allocating skiplist head");
+  }
+  head->level = MAX_LEVEL;
+
+  threads = (pthread_t *) malloc(sizeof(pthread_t)*num_threads);
+
+  if (!threads) {
+    panic("out of memory allocating thread handles");
+  }
+
+  // Insert keys in parallel
+  start = now();
+  for (i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, put_phase, (void *)i);
+  }
+
+  // Barrier
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  end = now();
+
+  printf("[main] Inserted %d keys in %f seconds\n", NUM_KEYS, end - start);
+
+  // Reset the thread array
+  memset(threads, 0, sizeof(pthread_t)*num_threads);
+
+  // Retrieve keys in parallel
+  start = now();
+  for (i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, get_phase, (void *)i);
+  }
+
+  // Collect count of lost keys
+  long total_lost = 0;
+  long *lost_keys = (long *) malloc(sizeof(long) * num_threads);
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], (void **)&lost_keys[i]);
+    total_lost += lost_keys[i];
+  }
+  end = now();
+
+  printf("[main] Retrieved %ld/%d keys in %f seconds\n", NUM_KEYS - total_lost, NUM_KEYS, end - start);
+
+  // random() repeats a key now and then, and the skiplist holds each key once
+  long distinct = range(0, (long) RAND_MAX + 1);
+
+  // Scan the key space in parallel ranges
+  memset(threads, 0, sizeof(pthread_t)*num_threads);
+  start = now();
+  for (i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i], NULL, range_phase, (void *)i);
+  }
+
+  long total_found = 0;
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], (void **)&lost_keys[i]);
+    total_found += lost_keys[i];
+  }
+  end = now();
+
+  printf("[main] Scanned %ld/%ld keys in %d ranges in %f seconds\n", total_found, distinct, NUM_RANGES, end - start);
+
+  return 0;
+}